@@ -0,0 +1,220 @@
+/*
+ * Timing of the per-frame hot paths, to compare against what they replaced
+ *
+ * Copyright (C) 2010 CERN (www.cern.ch)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <linux/kernel.h>
+#include <linux/netdevice.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/skbuff.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <asm/unaligned.h>
+
+#include "wr-nic.h"
+#include "nic-mem.h"
+
+/*
+ * This is only built with "make WRN_BENCH=y" and runs once at probe time,
+ * before the NIC is enabled, so the tx area of packet memory is unused.
+ * Each case is run WRN_BENCH_LOOPS times with interrupts off, and the
+ * average time per call is printed.
+ */
+#define WRN_BENCH_LOOPS 256
+
+#define WRN_BENCH_TIME(ns, expr) do {					\
+		unsigned long __flags;					\
+		ktime_t __t0;						\
+		int __l;						\
+		local_irq_save(__flags);				\
+		__t0 = ktime_get();					\
+		for (__l = 0; __l < WRN_BENCH_LOOPS; __l++)		\
+			expr;						\
+		ns = ktime_to_ns(ktime_sub(ktime_get(), __t0));		\
+		local_irq_restore(__flags);				\
+		ns = div_s64(ns, WRN_BENCH_LOOPS);			\
+	} while (0)
+
+static const int wrn_bench_sizes[] = {64, 256, 512, 1024, 1514};
+
+/* The copies as they were before the burst version, one access per word */
+static void __wrn_bench_copy_out_old(u32 __iomem *to, void *from, int size)
+{
+	from -= WRN_DDATA_OFFSET;
+	size += WRN_DDATA_OFFSET;
+	for (; size > 0; size -= sizeof(u32)) {
+		writel(get_unaligned_le32(from), to++);
+		from += sizeof(u32);
+	}
+}
+
+static void __wrn_bench_copy_in_old(void *to, u32 __iomem *from, int size)
+{
+	to -= WRN_DDATA_OFFSET;
+	size += WRN_DDATA_OFFSET;
+	for (; size > 0; size -= sizeof(u32)) {
+		put_unaligned_le32(readl(from++), to);
+		to += sizeof(u32);
+	}
+}
+
+static void wrn_bench_copy(struct wrn_dev *wrn, u8 *buf)
+{
+	u32 __iomem *mem = wrn->databuf + __wrn_rx_offset(wrn, WRN_NR_RXDESC);
+	void *data = buf + WRN_DDATA_OFFSET; /* like skb->data */
+	s64 old_out, new_out, old_in, new_in;
+	int i, len;
+
+	for (i = 0; i < ARRAY_SIZE(wrn_bench_sizes); i++) {
+		len = wrn_bench_sizes[i];
+		WRN_BENCH_TIME(old_out,
+			       __wrn_bench_copy_out_old(mem, data, len));
+		WRN_BENCH_TIME(new_out, __wrn_copy_out(mem, data, len));
+		WRN_BENCH_TIME(old_in,
+			       __wrn_bench_copy_in_old(data, mem, len));
+		WRN_BENCH_TIME(new_in, __wrn_copy_in(data, mem, len));
+		printk(KERN_INFO "%s: copy %4i bytes: out %lli -> %lli ns, "
+		       "in %lli -> %lli ns\n", DRV_NAME, len,
+		       old_out, new_out, old_in, new_in);
+	}
+}
+
+/* Lookup results go here, so that the calls are not optimized out */
+static struct wrn_tx_tstamp * volatile wrn_bench_ts;
+
+/* The stamp lookup as it was before WRN_TS_SLOT: a scan of the table */
+static noinline struct wrn_tx_tstamp *
+__wrn_bench_ts_old(struct wrn_tx_tstamp *tab, int id)
+{
+	int i;
+
+	for (i = 0; i < WRN_TS_BUF_SIZE; i++)
+		if (tab[i].valid && tab[i].frame_id == id)
+			return tab + i;
+	return NULL;
+}
+
+static noinline struct wrn_tx_tstamp *
+__wrn_bench_ts_new(struct wrn_tx_tstamp *tab, int id)
+{
+	struct wrn_tx_tstamp *t = tab + WRN_TS_SLOT(id);
+
+	if (t->valid && t->frame_id == id)
+		return t;
+	return NULL;
+}
+
+/*
+ * The table is full, like with a backlog of stamps nobody collected:
+ * "hit" is the last slot scanned, "miss" is an id that is not there.
+ */
+static void wrn_bench_tstamp(struct wrn_tx_tstamp *tab)
+{
+	int hit = WRN_TS_BUF_SIZE - 1, miss = WRN_TS_BUF_SIZE;
+	s64 old_hit, new_hit, old_miss, new_miss;
+	int i;
+
+	for (i = 0; i < WRN_TS_BUF_SIZE; i++) {
+		tab[i].valid = 1;
+		tab[i].frame_id = i;
+	}
+	WRN_BENCH_TIME(old_hit, wrn_bench_ts = __wrn_bench_ts_old(tab, hit));
+	WRN_BENCH_TIME(new_hit, wrn_bench_ts = __wrn_bench_ts_new(tab, hit));
+	WRN_BENCH_TIME(old_miss, wrn_bench_ts = __wrn_bench_ts_old(tab, miss));
+	WRN_BENCH_TIME(new_miss, wrn_bench_ts = __wrn_bench_ts_new(tab, miss));
+	printk(KERN_INFO "%s: tstamp lookup (%i stamps): hit %lli -> %lli ns, "
+	       "miss %lli -> %lli ns\n", DRV_NAME, WRN_TS_BUF_SIZE,
+	       old_hit, new_hit, old_miss, new_miss);
+}
+
+/*
+ * Fragmented frames with CHECKSUM_PARTIAL, as the stack sends them since
+ * we claim SG and HW_CSUM. "csum" is what wrn_start_xmit() does, a
+ * software checksum and a streamed copy; "linear" is what we'd do with
+ * no SG: copy the frame to a new linear buffer, then to packet memory.
+ * The frame is a 64-byte header and a page fragment for the rest.
+ */
+#define WRN_BENCH_HLEN 64
+
+static int wrn_bench_csum_one(u32 __iomem *mem, struct sk_buff *skb)
+{
+	skb->ip_summed = CHECKSUM_PARTIAL; /* skb_checksum_help() clears it */
+	if (skb_checksum_help(skb))
+		return -1;
+	__wrn_copy_out_skb(mem, skb);
+	return 0;
+}
+
+static int wrn_bench_linear_one(u32 __iomem *mem, struct sk_buff *skb)
+{
+	u8 *buf = kmalloc(skb->len + NET_IP_ALIGN, GFP_ATOMIC);
+
+	if (!buf)
+		return -1;
+	skb_copy_bits(skb, 0, buf + NET_IP_ALIGN, skb->len);
+	__wrn_copy_out(mem, buf + NET_IP_ALIGN, skb->len);
+	kfree(buf);
+	return 0;
+}
+
+static void wrn_bench_csum(struct wrn_dev *wrn)
+{
+	u32 __iomem *mem = wrn->databuf + __wrn_rx_offset(wrn, WRN_NR_RXDESC);
+	s64 csum, linear;
+	struct sk_buff *skb;
+	struct page *page;
+	int i, len;
+
+	for (i = 0; i < ARRAY_SIZE(wrn_bench_sizes); i++) {
+		len = wrn_bench_sizes[i];
+		if (len <= WRN_BENCH_HLEN)
+			continue;
+		skb = alloc_skb(WRN_BENCH_HLEN + NET_IP_ALIGN, GFP_KERNEL);
+		page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (!skb || !page) {
+			kfree_skb(skb);
+			if (page)
+				__free_page(page);
+			return;
+		}
+		skb_reserve(skb, NET_IP_ALIGN);
+		memset(skb_put(skb, WRN_BENCH_HLEN), 0, WRN_BENCH_HLEN);
+		skb_fill_page_desc(skb, 0, page, 0, len - WRN_BENCH_HLEN);
+		skb->len += len - WRN_BENCH_HLEN;
+		skb->data_len += len - WRN_BENCH_HLEN;
+		skb->truesize += PAGE_SIZE;
+		/* A TCP checksum field, after the Ethernet and IP headers */
+		skb_partial_csum_set(skb, ETH_HLEN + sizeof(struct iphdr), 16);
+
+		WRN_BENCH_TIME(csum, wrn_bench_csum_one(mem, skb));
+		WRN_BENCH_TIME(linear, wrn_bench_linear_one(mem, skb));
+		printk(KERN_INFO "%s: tx %4i bytes, fragmented: csum %lli ns, "
+		       "linear %lli ns\n", DRV_NAME, len, csum, linear);
+		kfree_skb(skb); /* and the page */
+	}
+}
+
+void wrn_bench_run(struct wrn_dev *wrn)
+{
+	struct wrn_tx_tstamp *tab;
+	u8 *buf;
+
+	buf = kzalloc(WRN_MTU + 2 * sizeof(u32), GFP_KERNEL);
+	if (!buf)
+		return;
+	wrn_bench_copy(wrn, buf);
+	kfree(buf);
+	wrn_bench_csum(wrn);
+
+	tab = kcalloc(WRN_TS_BUF_SIZE, sizeof(*tab), GFP_KERNEL);
+	if (!tab)
+		return;
+	wrn_bench_tstamp(tab);
+	kfree(tab);
+}
@@ -0,0 +1,174 @@
+/*
+ * Early rx classifier: rules are matched before an skb is allocated
+ *
+ * Copyright (C) 2010 CERN (www.cern.ch)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <linux/kernel.h>
+#include <linux/netdevice.h>
+#include <linux/if_vlan.h>
+#include <linux/slab.h>
+#include <linux/rtnetlink.h>
+#include <linux/uaccess.h>
+#include <asm/unaligned.h>
+
+#include "wr-nic.h"
+
+/*
+ * The table is replaced as a whole by the ioctl (under rtnl) and read
+ * by napi under rcu. Hit counters are only written by napi.
+ */
+struct wrn_cls_table {
+	int n_rules;
+	struct u64_stats_sync syncp;
+	struct wrn_cls_rule rule[0];
+};
+
+/*
+ * Called by napi with the first WRN_RX_PEEK_LEN bytes of the frame.
+ * The first matching rule wins; its argument is returned in *arg.
+ */
+int wrn_classify(struct wrn_dev *wrn, int port, const u8 *hdr, int *arg)
+{
+	struct wrn_cls_table *t;
+	struct wrn_cls_rule *r;
+	int i, k, action = WRN_CLS_NOMATCH;
+	u16 etype, vid = WRN_CLS_NO_VID;
+
+	rcu_read_lock();
+	t = rcu_dereference(wrn->cls);
+	if (!t)
+		goto out;
+
+	etype = get_unaligned_be16(hdr + 2 * ETH_ALEN);
+	if (etype == ETH_P_8021Q) {
+		vid = get_unaligned_be16(hdr + ETH_HLEN) & VLAN_VID_MASK;
+		etype = get_unaligned_be16(hdr + ETH_HLEN + 2);
+	}
+
+	for (i = 0, r = t->rule; i < t->n_rules; i++, r++) {
+		if ((r->match & WRN_CLS_M_PORT) && r->port != port)
+			continue;
+		if ((r->match & WRN_CLS_M_ETYPE) && r->ethertype != etype)
+			continue;
+		if ((r->match & WRN_CLS_M_VLAN) && r->vid != vid)
+			continue;
+		if (r->match & WRN_CLS_M_DMAC) {
+			for (k = 0; k < ETH_ALEN; k++)
+				if ((hdr[k] ^ r->dmac[k]) & r->dmac_mask[k])
+					break;
+			if (k < ETH_ALEN)
+				continue;
+		}
+		u64_stats_update_begin(&t->syncp);
+		r->hits++;
+		u64_stats_update_end(&t->syncp);
+		action = r->action;
+		*arg = r->arg;
+		break;
+	}
+out:
+	rcu_read_unlock();
+	return action;
+}
+
+static int wrn_cls_check(struct wrn_dev *wrn, struct wrn_cls_rule *r)
+{
+	if (r->match & ~WRN_CLS_M_ALL)
+		return -EINVAL;
+	if ((r->match & WRN_CLS_M_PORT) && r->port >= WRN_NR_ENDPOINTS)
+		return -EINVAL;
+	if ((r->match & WRN_CLS_M_VLAN) && r->vid > VLAN_VID_MASK
+	    && r->vid != WRN_CLS_NO_VID)
+		return -EINVAL;
+	switch (r->action) {
+	case WRN_CLS_PASS:
+	case WRN_CLS_DROP:
+	case WRN_CLS_PRIO:
+		return 0;
+	case WRN_CLS_MIRROR:
+		if (r->arg >= WRN_NR_ENDPOINTS || !wrn->dev[r->arg])
+			return -ENODEV;
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+/* Replace the table (PRIV_IOCSCLASSIFY) or read it back with counters */
+int wrn_cls_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+	struct wrn_dev *wrn = ep->wrn;
+	struct wrn_cls_table *t, *old;
+	struct wrn_cls_req *req;
+	unsigned int start;
+	int i, err = 0;
+
+	req = kzalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+
+	if (cmd == PRIV_IOCGCLASSIFY) {
+		t = rtnl_dereference(wrn->cls);
+		for (i = 0; t && i < t->n_rules; i++) {
+			do {
+				start = u64_stats_fetch_begin_bh(&t->syncp);
+				req->rule[i] = t->rule[i];
+			} while (u64_stats_fetch_retry_bh(&t->syncp, start));
+		}
+		req->n_rules = t ? t->n_rules : 0;
+		if (copy_to_user(rq->ifr_data, req, sizeof(*req)))
+			err = -EFAULT;
+		goto out;
+	}
+
+	if (!capable(CAP_NET_ADMIN)) {
+		err = -EPERM;
+		goto out;
+	}
+	if (copy_from_user(req, rq->ifr_data, sizeof(*req))) {
+		err = -EFAULT;
+		goto out;
+	}
+	if (req->n_rules > WRN_CLS_MAX_RULES) {
+		err = -EINVAL;
+		goto out;
+	}
+	for (i = 0; i < req->n_rules; i++)
+		if ( (err = wrn_cls_check(wrn, req->rule + i)) )
+			goto out;
+
+	t = NULL; /* An empty table turns the classifier off */
+	if (req->n_rules) {
+		t = kmalloc(sizeof(*t) + req->n_rules * sizeof(t->rule[0]),
+			    GFP_KERNEL);
+		if (!t) {
+			err = -ENOMEM;
+			goto out;
+		}
+		t->n_rules = req->n_rules;
+		u64_stats_init(&t->syncp);
+		for (i = 0; i < t->n_rules; i++) {
+			t->rule[i] = req->rule[i];
+			t->rule[i].hits = 0;
+		}
+	}
+	old = rtnl_dereference(wrn->cls);
+	rcu_assign_pointer(wrn->cls, t);
+	synchronize_rcu();
+	kfree(old);
+out:
+	kfree(req);
+	return err;
+}
+
+/* Called at remove time, when napi is already stopped */
+void wrn_cls_exit(struct wrn_dev *wrn)
+{
+	kfree(rcu_dereference_protected(wrn->cls, 1));
+	rcu_assign_pointer(wrn->cls, NULL);
+}
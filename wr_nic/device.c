@@ -18,7 +18,10 @@
 #include <linux/platform_device.h>
 #include <linux/spinlock.h>
 #include <linux/delay.h>
+#include <linux/interrupt.h>
 #include <linux/io.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
 
 #include "wr-nic.h"
 #include "nic-mem.h"
@@ -33,10 +36,48 @@ static int __devexit wrn_remove(struct platform_device *pdev)
 	--wrn->use_count; /* Hmmm... looks like overkill... */
 	spin_unlock(&wrn->lock);
 
-	/* First of all, stop any transmission */
-	writel(0, &wrn->regs->CR);
+	/*
+	 * First of all, stop the NIC and its interrupts: the handlers schedule
+	 * napi, the tasklet and the timers, that are stopped later
+	 */
+	if (wrn->regs) {
+		writel(0, &wrn->regs->CR);
+		writel(~0, (void *)wrn->regs + WRN_NIC_EIC_IDR);
+	}
+	if (wrn->txtsu_regs)
+		writel(TXTSU_EIC_IDR_NEMPTY, &wrn->txtsu_regs->EIC_IDR);
+	for (i = 0; wrn->irq_registered; i++) {
+		static int irqs[] = WRN_IRQ_NUMBERS;
+		if (wrn->irq_registered & (1 << i))
+			free_irq(irqs[i], wrn);
+		wrn->irq_registered &= ~(1 << i);
+	}
+
+	wrn_ptp_exit(wrn);
+	if (wrn->works_running) {
+		wrn_rmon_exit(wrn);
+		wrn_link_exit(wrn);
+		wrn->works_running = 0;
+	}
+
+	/* No more RX processing: the netdevs are going away */
+	if (wrn->napi_registered) {
+		wrn_coalesce_stop(wrn);
+		napi_disable(&wrn->napi);
+		netif_napi_del(&wrn->napi);
+		wrn_rx_pool_exit(wrn);
+		wrn->napi_registered = 0;
+	}
+	wrn_tstamp_release(wrn);
+	wrn_pch_exit(wrn);
+	wrn_dmtd_exit(wrn);
+	wrn_cls_exit(wrn);
+	if (wrn->regs_misc_registered) {
+		misc_deregister(&wrn->regs_misc);
+		wrn->regs_misc_registered = 0;
+	}
 
-	/* Then remove devices, memory maps, interrupts */
+	/* Then remove devices and memory maps */
 	for (i = 0; i < WRN_NR_ENDPOINTS; i++) {
 		if (wrn->dev[i]) {
 			wrn_endpoint_remove(wrn->dev[i]);
@@ -49,13 +90,98 @@ static int __devexit wrn_remove(struct platform_device *pdev)
 		if (wrn->bases[i])
 			iounmap(wrn->bases[i]);
 	}
+	return 0;
+}
 
-	/* Unregister all interrupts that were registered */
-	for (i = 0; wrn->irq_registered; i++) {
-		static int irqs[] = WRN_IRQ_NUMBERS;
-		if (wrn->irq_registered & (1 << i))
-			free_irq(irqs[i], wrn);
-		wrn->irq_registered &= ~(1 << i);
+/* Prepare all descriptors and ring pointers. NIC must be disabled */
+static void __wrn_init_descriptors(struct wrn_dev *wrn)
+{
+	int i;
+
+	for (i = 0; i < WRN_NR_TXDESC; i++) { /* Clear all tx descriptors */
+		struct wrn_txd *tx;
+		tx = wrn->txd + i;
+		writel(0, &tx->tx1);
+	}
+
+	/* Now, prepare RX descriptors */
+	for (i = 0; i < WRN_NR_RXDESC; i++)
+		__wrn_rx_desc_reload(wrn, i);
+
+	/*
+	 * make sure all head/tail are 0 -- not needed at probe time, but
+	 * if we disable and then re-enable, this _is_ needed
+	 */
+	wrn->next_tx_head = wrn->next_tx_tail = wrn->next_rx = 0;
+	wrn->tx_inflight = 0;
+}
+
+/*
+ * Change the rx slot size at run time (for mtu changes). Everything is
+ * stopped: transmission, interrupts, then NAPI, and restarted in reverse
+ * order (an interrupt while NAPI is off would mask RCOMP with no poll to
+ * unmask it); pending tx frames are dropped. The rings are rebuilt under
+ * the lock, as tx reserves and fires under it.
+ */
+int wrn_set_rings(struct wrn_dev *wrn, int frame)
+{
+	static int irqs[] = WRN_IRQ_NUMBERS;
+	unsigned long flags;
+	int i;
+
+	if (!WRN_FRAME_FITS(frame))
+		return -EINVAL;
+
+	/* wrn_tx_raw() has no queue to stop: it checks rings_busy */
+	spin_lock_irqsave(&wrn->lock, flags);
+	wrn->rings_busy = 1;
+	spin_unlock_irqrestore(&wrn->lock, flags);
+	for (i = 0; i < WRN_NR_ENDPOINTS; i++)
+		if (wrn->dev[i])
+			netif_tx_disable(wrn->dev[i]);
+	for (i = 0; i < ARRAY_SIZE(irqs); i++)
+		disable_irq(irqs[i]);
+	napi_disable(&wrn->napi);
+	wrn_coalesce_stop(wrn);
+	/* A frame wrn_tx_raw() is copying is fired before it clears this */
+	while (ACCESS_ONCE(wrn->tx_copying))
+		msleep(1);
+
+	spin_lock_irqsave(&wrn->lock, flags);
+	writel(0, &wrn->regs->CR);
+	for (i = 0; i < WRN_NR_TXDESC; i++) {
+		if (wrn->skb_desc[i].skb)
+			dev_kfree_skb_any(wrn->skb_desc[i].skb);
+		wrn->skb_desc[i].skb = NULL;
+	}
+	wrn->frame_max = frame;
+	wrn->desc_size = WRN_DESC_SIZE(frame);
+	__wrn_init_descriptors(wrn);
+	writel(NIC_CR_RX_EN | NIC_CR_TX_EN, &wrn->regs->CR);
+	/* A stopped moderation timer may have left TCOMP or RCOMP masked */
+	writel(NIC_EIC_IER_TCOMP | NIC_EIC_IER_RCOMP,
+	       (void *)wrn->regs + WRN_NIC_EIC_IER);
+	spin_unlock_irqrestore(&wrn->lock, flags);
+
+	napi_enable(&wrn->napi);
+	for (i = 0; i < ARRAY_SIZE(irqs); i++)
+		enable_irq(irqs[i]);
+	/* Frames may have come before RCOMP was unmasked: poll once */
+	local_bh_disable();
+	napi_schedule(&wrn->napi);
+	local_bh_enable();
+
+	spin_lock_irqsave(&wrn->lock, flags);
+	wrn->rings_busy = 0;
+	spin_unlock_irqrestore(&wrn->lock, flags);
+	if (test_bit(0, &wrn->pch_busy))
+		wake_up_interruptible(&wrn->pch_wait);
+	for (i = 0; i < WRN_NR_ENDPOINTS; i++) {
+		if (!wrn->dev[i])
+			continue;
+		wrn_ep_reset_txq(wrn->dev[i]);
+		if (netif_running(wrn->dev[i]))
+			netif_tx_wake_all_queues(wrn->dev[i]);
 	}
 	return 0;
 }
@@ -86,16 +212,74 @@ static int __devinit __wrn_map_resources(struct platform_device *pdev)
 		pr_debug("Remapped %08x (block %i) to %p\n",
 			 res->start, i, ptr);
 		wrn->bases[i] = ptr;
+		wrn->phys[i] = res->start;
 	}
 	return 0;
 }
 
+/*
+ * Read-only mapping of the EP and PPSG windows (layout in wr-nic.h), so
+ * monitoring can read DSR, DMSR and the PPSG counters without syscalls.
+ * Writers must go through the driver: write access is refused.
+ */
+static struct wrn_dev *regs_misc_to_wrn(struct file *f)
+{
+	return container_of(f->private_data, struct wrn_dev, regs_misc);
+}
+
+static int wrn_regs_open(struct inode *inode, struct file *f)
+{
+	if (f->f_mode & FMODE_WRITE)
+		return -EPERM;
+	return 0;
+}
+
+static int wrn_regs_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	struct wrn_dev *wrn = regs_misc_to_wrn(f);
+	unsigned long off = vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	resource_size_t phys;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	if (off + size <= WRN_REGS_MMAP_PPSG)
+		phys = wrn->phys[WRN_FB_EP] + off - WRN_REGS_MMAP_EP;
+	else if (off >= WRN_REGS_MMAP_PPSG && off + size <= WRN_REGS_MMAP_SIZE)
+		phys = wrn->phys[WRN_FB_PPSG] + off - WRN_REGS_MMAP_PPSG;
+	else
+		return -EINVAL;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	return io_remap_pfn_range(vma, vma->vm_start, phys >> PAGE_SHIFT,
+				  size, vma->vm_page_prot);
+}
+
+static const struct file_operations wrn_regs_fops = {
+	.owner		= THIS_MODULE,
+	.open		= wrn_regs_open,
+	.mmap		= wrn_regs_mmap,
+};
+
+/* The device is optional: only warn if it's not there */
+static void wrn_regs_misc_init(struct wrn_dev *wrn)
+{
+	wrn->regs_misc.minor = MISC_DYNAMIC_MINOR;
+	wrn->regs_misc.name = "wr-regs";
+	wrn->regs_misc.fops = &wrn_regs_fops;
+	if (misc_register(&wrn->regs_misc) < 0)
+		printk(KERN_WARNING "%s: can't register wr-regs\n", __func__);
+	else
+		wrn->regs_misc_registered = 1;
+}
+
 static int __devinit wrn_probe(struct platform_device *pdev)
 {
 	struct net_device *netdev;
 	struct wrn_ep *ep;
 	struct wrn_dev *wrn = pdev->dev.platform_data;
-	int i, err = 0;
+	int i, j, err = 0;
 
 	/* Lazily: irqs are not in the resource list */
 	static int irqs[] = WRN_IRQ_NUMBERS;
@@ -117,12 +301,21 @@ static int __devinit wrn_probe(struct platform_device *pdev)
 	wrn->regs = wrn->bases[WRN_FB_NIC];
 	wrn->txtsu_regs = wrn->bases[WRN_FB_TS];
 	wrn->ppsg_regs = wrn->bases[WRN_FB_PPSG];
-	wrn->txd = ((void *)wrn->regs) + 0x80; /* was: TX1_D1 */
-	wrn->rxd = ((void *)wrn->regs) + 0x100; /* was: RX1_D1 */
+	wrn->txd = ((void *)wrn->regs) + WRN_NIC_TXD_OFFSET; /* was: TX1_D1 */
+	wrn->rxd = ((void *)wrn->regs) + WRN_NIC_RXD_OFFSET; /* was: RX1_D1 */
 	wrn->databuf = (void *)wrn->regs + offsetof(struct NIC_WB, MEM);
 	printk("regs %p, txd %p, rxd %p, buffer %p\n",
 	       wrn->regs, wrn->txd, wrn->rxd, wrn->databuf);
 
+	/* NAPI must be ready before the interrupt handler can schedule it */
+	init_dummy_netdev(&wrn->napi_dev);
+	wrn_coalesce_init(wrn);
+	wrn_rx_pool_init(wrn);
+	u64_stats_init(&wrn->rx_syncp);
+	netif_napi_add(&wrn->napi_dev, &wrn->napi, wrn_poll, WRN_NAPI_WEIGHT);
+	napi_enable(&wrn->napi);
+	wrn->napi_registered = 1;
+
 	/* Register the interrupt handlers (not shared) */
 	for (i = 0; i < ARRAY_SIZE(irq_names); i++) {
 		err = request_irq(irqs[i], irq_handlers[i],
@@ -136,8 +329,12 @@ static int __devinit wrn_probe(struct platform_device *pdev)
 
 	/* Finally, register one interface per endpoint */
 	memset(wrn->dev, 0, sizeof(wrn->dev));
+	/* Start periodic works first: wrn_ep_open() kicks the link poller */
+	wrn_rmon_init(wrn);
+	wrn_link_init(wrn);
+	wrn->works_running = 1;
 	for (i = 0; i < WRN_NR_ENDPOINTS; i++) {
-		netdev = alloc_etherdev(sizeof(struct wrn_ep));
+		netdev = alloc_etherdev_mq(sizeof(struct wrn_ep), WRN_NR_TXQ);
 		if (!netdev) {
 			dev_err(&pdev->dev, "Etherdev alloc failed.\n");
 			err = -ENOMEM;
@@ -149,6 +346,10 @@ static int __devinit wrn_probe(struct platform_device *pdev)
 		ep->ep_regs = wrn->bases[WRN_FB_EP] + i * FPGA_SIZE_EACH_EP;
 		printk("ep %p, regs %i = %p\n", ep, i, ep->ep_regs);
 		ep->ep_number = i;
+		for (j = 0; j < WRN_NR_TXQ; j++)
+			skb_queue_head_init(&ep->txq[j]);
+		u64_stats_init(&ep->tx_stats.syncp);
+		u64_stats_init(&ep->rx_stats.syncp);
 #if 0 /* FIXME: UPlink or not? */
 		if (i < WRN_NR_UPLINK)
 			set_bit(WRN_EP_IS_UPLINK, &ep->ep_flags);
@@ -164,34 +365,18 @@ static int __devinit wrn_probe(struct platform_device *pdev)
 		wrn->dev[i] = netdev;
 	}
 
-	for (i = 0; i < WRN_NR_TXDESC; i++) { /* Clear all tx descriptors */
-		struct wrn_txd *tx;
-		tx = wrn->txd + i;
-		writel(0, &tx->tx1);
-	}
-
-	/* Now, prepare RX descriptors */
-	for (i = 0; i < WRN_NR_RXDESC; i++) {
-		struct wrn_rxd *rx;
-		int offset;
-
-		rx = wrn->rxd + i;
-		offset = __wrn_desc_offset(wrn, WRN_DDIR_RX, i);
-		writel( (2000 << 16) | offset, &rx->rx3);
-		writel(NIC_RX1_D1_EMPTY, &rx->rx1);
-	}
-
-	/*
-	 * make sure all head/tail are 0 -- not needed here, but if we
-	 * disable and then re-enable, this _is_ needed
-	 */
-	wrn->next_tx_head = wrn->next_tx_tail = wrn->next_rx = 0;
+	__wrn_init_descriptors(wrn);
+	wrn_bench_run(wrn); /* no-op unless WRN_BENCH=y */
 
 	writel(NIC_CR_RX_EN | NIC_CR_TX_EN, &wrn->regs->CR);
-	writel(~0, (void *)wrn->regs + 0x24 /* EIC_IER */);
-	printk("imr: %08x\n", readl((void *)wrn->regs + 0x28 /* EIC_IMR */));
+	writel(~0, (void *)wrn->regs + WRN_NIC_EIC_IER);
+	printk("imr: %08x\n", readl((void *)wrn->regs + WRN_NIC_EIC_IMR));
 
 	wrn_tstamp_init(wrn);
+	wrn_pch_init(wrn);
+	wrn_dmtd_init(wrn);
+	wrn_regs_misc_init(wrn);
+	wrn_ptp_init(wrn, &pdev->dev);
 	err = 0;
 out:
 	if (err) {
@@ -12,36 +12,63 @@
  */
 #include <linux/kernel.h>
 #include <linux/netdevice.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
 
 #include "wr-nic.h"
 
+/* Sign-extend the 24-bit sum from DMSR */
+static s32 __wrn_dmtd_raw(u32 dmsr)
+{
+	s32 ph = EP_DMSR_PS_VAL_R(dmsr);
+
+	if(ph & 0x800000)
+	    ph |= 0xff << 24;
+	return ph;
+}
+
+static u32 __wrn_dmtd_phase(s32 raw, int n_avg)
+{
+	/* Divide by nsamples (average) */
+	raw /= n_avg;
+
+	/* Put it back in the proper range */
+	return (raw + WRN_DMTD_MAX_PHASE) % WRN_DMTD_MAX_PHASE;
+}
+
+/*
+ * PS_RDY stays set until the bus writes it (LOAD_EXT in endpoint-regs.wb).
+ * While /dev/wr-dmtd is open the poll work acknowledges each result, so
+ * we return the last one it collected, if not returned yet.
+ */
 int wrn_phase_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
 {
 	struct wrn_phase_req phase_req;
 	struct wrn_ep *ep = netdev_priv(dev);
+	struct wrn_dev *wrn = ep->wrn;
+	unsigned long flags;
 	u32 dmsr;
-	s32 ph;
 
 	phase_req.phase = 0;
 	phase_req.ready = 0;
 
-	dmsr = readl(&ep->ep_regs->DMSR);
-
-	if(dmsr & EP_DMSR_PS_RDY) {
-		ph = EP_DMSR_PS_VAL_R(dmsr);
-
-		/* Sign-extend the 24-bit value */
-		if(ph & 0x800000)
-		    ph |= 0xff << 24;
-
-		/* Divide by nsamples (average) */
-		ph /= WRN_DMTD_AVG_SAMPLES;
-
-		/* Put it back in the proper range */
-		ph = (ph + WRN_DMTD_MAX_PHASE) % WRN_DMTD_MAX_PHASE;
-
-		phase_req.phase = ph;
-		phase_req.ready = 1;
+	if (atomic_read(&wrn->dmtd_users)) {
+		spin_lock_irqsave(&wrn->lock, flags);
+		if (ep->dmtd_new) {
+			phase_req.phase = ep->dmtd_phase;
+			phase_req.ready = 1;
+			ep->dmtd_new = 0;
+		}
+		spin_unlock_irqrestore(&wrn->lock, flags);
+	} else {
+		dmsr = readl(&ep->ep_regs->DMSR);
+		if(dmsr & EP_DMSR_PS_RDY) {
+			phase_req.phase = __wrn_dmtd_phase(
+				__wrn_dmtd_raw(dmsr), ep->dmtd_avg);
+			phase_req.ready = 1;
+		}
 	}
 
 	if (copy_to_user(rq->ifr_data, &phase_req, sizeof(phase_req)))
@@ -49,6 +76,24 @@ int wrn_phase_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
 	return 0;
 }
 
+/* Change the averaging window of one endpoint; used at next open too */
+int wrn_dmtd_avg_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+	u32 n;
+
+	if (!capable(CAP_NET_ADMIN))
+		return -EPERM;
+	if (get_user(n, (u32 *)rq->ifr_data) < 0)
+		return -EFAULT;
+	if (n < 1 || n > WRN_DMTD_AVG_MAX)
+		return -EINVAL;
+	ep->dmtd_avg = n;
+	if (netif_running(dev))
+		writel(EP_DMCR_EN | EP_DMCR_N_AVG_W(n), &ep->ep_regs->DMCR);
+	return 0;
+}
+
 int wrn_calib_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
 {
 	struct wrn_calibration_req cal_req;
@@ -63,6 +108,7 @@ int wrn_calib_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
 			return -EIO; /* was -EFAULT in minic */
 	}
 
+	mutex_lock(&ep->wrn->mdio_mutex);
 	switch(cal_req.cmd) {
 	case WRN_CAL_TX_ON:
 		tmp = wrn_phy_read(dev, 0, WRN_MDIO_WR_SPEC);
@@ -87,16 +133,174 @@ int wrn_calib_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
 		break;
 
 	case WRN_CAL_RX_CHECK:
-		tmp = wrn_phy_read(dev, 0, WRN_MDIO_WR_SPEC);
+		/* The status bit is not cached, go to the phy */
+		tmp = wrn_phy_read_uncached(dev, WRN_MDIO_WR_SPEC);
 
 		cal_req.cal_present = tmp & WRN_MDIO_WR_SPEC_RX_CAL_STAT
 			? 1 : 0;
-
-		if (copy_to_user(rq->ifr_data,&cal_req,
-				 sizeof(cal_req)))
-			return -EFAULT;
 		break;
 	}
+	mutex_unlock(&ep->wrn->mdio_mutex);
 
+	if (cal_req.cmd == WRN_CAL_RX_CHECK
+	    && copy_to_user(rq->ifr_data,&cal_req, sizeof(cal_req)))
+		return -EFAULT;
 	return 0;
 }
+
+/*
+ * The phase ring. There is no DMTD interrupt, so a delayed work collects
+ * new results from running endpoints while the device is open. The time
+ * of collection is read from the PPS generator once per round.
+ */
+static void __wrn_dmtd_publish(struct wrn_dev *wrn, struct wrn_ep *ep,
+			       s32 raw, u32 utc, u32 cnt)
+{
+	struct wrn_dmtd_ring *ring = wrn->dmtd_ring;
+	struct wrn_dmtd_rec *rec;
+	unsigned long flags;
+	u32 head;
+
+	head = ring->head;
+	rec = ring->rec + (head & (WRN_DMTD_RING_SIZE - 1));
+	rec->sec = utc;
+	rec->nsec = cnt * NSEC_PER_TICK;
+	rec->port = ep->ep_number;
+	rec->n_avg = ep->dmtd_avg;
+	rec->raw = raw;
+	rec->phase = __wrn_dmtd_phase(raw, ep->dmtd_avg);
+	smp_wmb(); /* record before head */
+	ring->head = head + 1;
+
+	spin_lock_irqsave(&wrn->lock, flags);
+	ep->dmtd_phase = rec->phase;
+	ep->dmtd_new = 1;
+	spin_unlock_irqrestore(&wrn->lock, flags);
+}
+
+static void wrn_dmtd_work(struct work_struct *work)
+{
+	struct wrn_dev *wrn = container_of(to_delayed_work(work),
+					   struct wrn_dev, dmtd_work);
+	struct wrn_ep *ep;
+	u32 dmsr, utc, cnt;
+	int i, n = 0;
+
+	if (!atomic_read(&wrn->dmtd_users))
+		return; /* last close: don't reschedule */
+
+	for (i = 0; i < WRN_NR_ENDPOINTS; i++) {
+		if (!wrn->dev[i] || !netif_running(wrn->dev[i]))
+			continue;
+		ep = netdev_priv(wrn->dev[i]);
+		dmsr = readl(&ep->ep_regs->DMSR);
+		if (!(dmsr & EP_DMSR_PS_RDY))
+			continue;
+		if (!n++)
+			wrn_ppsg_read_time(wrn, &cnt, &utc);
+		__wrn_dmtd_publish(wrn, ep, __wrn_dmtd_raw(dmsr), utc, cnt);
+		/* Result taken: clear PS_RDY only, write back the rest */
+		writel(dmsr & ~EP_DMSR_PS_RDY, &ep->ep_regs->DMSR);
+	}
+	if (n)
+		wake_up_interruptible(&wrn->dmtd_wait);
+
+	schedule_delayed_work(&wrn->dmtd_work, WRN_DMTD_INTERVAL);
+}
+
+static struct wrn_dev *dmtd_misc_to_wrn(struct file *f)
+{
+	return container_of(f->private_data, struct wrn_dev, dmtd_misc);
+}
+
+/* Like for wr-tstamp, the ring is kept until the module is removed */
+static int wrn_dmtd_open(struct inode *inode, struct file *f)
+{
+	struct wrn_dev *wrn = dmtd_misc_to_wrn(f);
+	struct wrn_dmtd_ring *ring;
+	unsigned long flags;
+
+	if (!wrn->dmtd_ring) {
+		ring = vmalloc_user(PAGE_ALIGN(sizeof(*ring)));
+		if (!ring)
+			return -ENOMEM;
+		ring->size = WRN_DMTD_RING_SIZE;
+
+		spin_lock_irqsave(&wrn->lock, flags);
+		if (!wrn->dmtd_ring) {
+			wrn->dmtd_ring = ring;
+			ring = NULL;
+		}
+		spin_unlock_irqrestore(&wrn->lock, flags);
+		vfree(ring); /* lost a race with another open */
+	}
+
+	/* The work stops by itself after the last release */
+	if (atomic_inc_return(&wrn->dmtd_users) == 1)
+		schedule_delayed_work(&wrn->dmtd_work, WRN_DMTD_INTERVAL);
+	return 0;
+}
+
+static int wrn_dmtd_release(struct inode *inode, struct file *f)
+{
+	struct wrn_dev *wrn = dmtd_misc_to_wrn(f);
+
+	atomic_dec(&wrn->dmtd_users);
+	return 0;
+}
+
+static int wrn_dmtd_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	struct wrn_dmtd_ring *ring = dmtd_misc_to_wrn(f)->dmtd_ring;
+
+	if (vma->vm_pgoff
+	    || vma->vm_end - vma->vm_start > PAGE_ALIGN(sizeof(*ring)))
+		return -EINVAL;
+	return remap_vmalloc_range(vma, ring, 0);
+}
+
+static unsigned int wrn_dmtd_poll(struct file *f, poll_table *wait)
+{
+	struct wrn_dev *wrn = dmtd_misc_to_wrn(f);
+	struct wrn_dmtd_ring *ring = wrn->dmtd_ring;
+
+	poll_wait(f, &wrn->dmtd_wait, wait);
+	if (ACCESS_ONCE(ring->head) != ACCESS_ONCE(ring->tail))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static const struct file_operations wrn_dmtd_fops = {
+	.owner		= THIS_MODULE,
+	.open		= wrn_dmtd_open,
+	.release	= wrn_dmtd_release,
+	.mmap		= wrn_dmtd_mmap,
+	.poll		= wrn_dmtd_poll,
+};
+
+/* The ring is optional: only warn if it's not there */
+void wrn_dmtd_init(struct wrn_dev *wrn)
+{
+	init_waitqueue_head(&wrn->dmtd_wait);
+	atomic_set(&wrn->dmtd_users, 0);
+	INIT_DELAYED_WORK(&wrn->dmtd_work, wrn_dmtd_work);
+
+	wrn->dmtd_misc.minor = MISC_DYNAMIC_MINOR;
+	wrn->dmtd_misc.name = "wr-dmtd";
+	wrn->dmtd_misc.fops = &wrn_dmtd_fops;
+	if (misc_register(&wrn->dmtd_misc) < 0)
+		printk(KERN_WARNING "%s: can't register wr-dmtd\n", __func__);
+	else
+		wrn->dmtd_misc_registered = 1;
+}
+
+void wrn_dmtd_exit(struct wrn_dev *wrn)
+{
+	if (wrn->dmtd_misc_registered) {
+		misc_deregister(&wrn->dmtd_misc);
+		cancel_delayed_work_sync(&wrn->dmtd_work); /* if opened */
+		wrn->dmtd_misc_registered = 0;
+	}
+	vfree(wrn->dmtd_ring);
+	wrn->dmtd_ring = NULL;
+}
@@ -15,73 +15,273 @@
 #include <linux/errno.h>
 #include <linux/etherdevice.h>
 #include <linux/io.h>
+#include <linux/workqueue.h>
+#include <linux/delay.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
 
 #include "wr-nic.h"
 
 /*
  * Phy access: used by link status, enable, calibration ioctl etc.
- * Called with endpoint lock (you'll lock the whole sequence of r/w)
+ * Called with wrn->mdio_mutex (you'll lock the whole sequence of r/w).
+ * Each endpoint has its own MDIO master, so reads can be started on
+ * several endpoints and collected later (see wrn_link_work below).
+ * We run in process context with interrupts on, and the wait is bounded.
  */
-int wrn_phy_read(struct net_device *dev, int phy_id, int location)
+static int __wrn_phy_wait(struct wrn_ep *ep)
 {
-	struct wrn_ep *ep = netdev_priv(dev);
-	u32 val;
+	int i;
 
+	for (i = 0; i < WRN_MDIO_TIMEOUT_US; i++) {
+		if (wrn_ep_read(ep, MDIO_ASR) & EP_MDIO_ASR_READY)
+			return 0;
+		udelay(1);
+	}
+	if (net_ratelimit())
+		printk(KERN_WARNING "%s: MDIO timeout\n", ep->mii.dev->name);
+	return -ETIMEDOUT;
+}
+
+static void __wrn_phy_start_read(struct wrn_ep *ep, int location)
+{
 	wrn_ep_write(ep, MDIO_CR, EP_MDIO_CR_ADDR_W(location));
-	while( (wrn_ep_read(ep, MDIO_ASR) & EP_MDIO_ASR_READY) == 0)
-		;
+}
+
+/* A timeout reads as all-ones, like a missing phy */
+static int __wrn_phy_end_read(struct wrn_ep *ep)
+{
+	u32 val;
+
+	if (__wrn_phy_wait(ep))
+		return 0xffff;
 	val = wrn_ep_read(ep, MDIO_ASR);
 	/* mask from wbgen macros */
 	return EP_MDIO_ASR_RDATA_R(val);
 }
 
+/*
+ * Write-through cache for the registers only we change. Bits that the
+ * phy changes by itself (self-clearing or status) are never cached, so
+ * they read as 0 from the cache: use wrn_phy_read_uncached() for them.
+ */
+static const struct {
+	int location;
+	u16 volatile_bits;
+} wrn_phy_cached[WRN_PHY_NR_CACHED] = {
+	{MII_BMCR, BMCR_RESET | BMCR_ANRESTART},
+	{MII_ADVERTISE, 0},
+	{WRN_MDIO_WR_SPEC,
+	 WRN_MDIO_WR_SPEC_RX_CAL_STAT | WRN_MDIO_WR_SPEC_CAL_CRST},
+};
+
+static int __wrn_phy_cache_slot(int location)
+{
+	int i;
+
+	for (i = 0; i < WRN_PHY_NR_CACHED; i++)
+		if (wrn_phy_cached[i].location == location)
+			return i;
+	return -1;
+}
+
+int wrn_phy_read_uncached(struct net_device *dev, int location)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+
+	__wrn_phy_start_read(ep, location);
+	return __wrn_phy_end_read(ep);
+}
+
+int wrn_phy_read(struct net_device *dev, int phy_id, int location)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+	int i = __wrn_phy_cache_slot(location);
+	int val;
+
+	if (i >= 0 && ep->phy_cache_valid & (1 << i))
+		return ep->phy_cache[i];
+	val = wrn_phy_read_uncached(dev, location);
+	if (i >= 0 && val != 0xffff) {
+		ep->phy_cache[i] = val & ~wrn_phy_cached[i].volatile_bits;
+		ep->phy_cache_valid |= 1 << i;
+	}
+	return val;
+}
+
 void wrn_phy_write(struct net_device *dev, int phy_id, int location,
 		      int value)
 {
 	struct wrn_ep *ep = netdev_priv(dev);
+	int i = __wrn_phy_cache_slot(location);
+
 	wrn_ep_write(ep, MDIO_CR,
 		     EP_MDIO_CR_ADDR_W(location)
 		     | EP_MDIO_CR_DATA_W(value)
 		     | EP_MDIO_CR_RW);
-	while( (wrn_ep_read(ep, MDIO_ASR) & EP_MDIO_ASR_READY) == 0)
-		;
+	if (__wrn_phy_wait(ep) < 0) {
+		ep->phy_cache_valid = 0; /* we don't know what happened */
+		return;
+	}
+	if (location == MII_BMCR && value & BMCR_RESET) {
+		ep->phy_cache_valid = 0; /* back to phy defaults */
+		return;
+	}
+	if (i >= 0) {
+		ep->phy_cache[i] = value & ~wrn_phy_cached[i].volatile_bits;
+		ep->phy_cache_valid |= 1 << i;
+	}
 }
 
-/* One link status poll per endpoint -- called with endpoint lock */
-static void wrn_update_link_status(struct net_device *dev)
+/*
+ * RMON counters are 32 bits in hardware and are reset at link-up.
+ * We extend them to 64 bits from a periodic snapshot (and one before
+ * every reset), so ethtool -S reads memory only. Called with ep->lock.
+ */
+static void __wrn_ep_rmon_update(struct wrn_ep *ep)
 {
-	struct wrn_ep *ep = netdev_priv(dev);
-	u32 ecr, bmsr, bmcr, lpa;
+	u32 val;
+	int i;
 
-	bmsr = wrn_phy_read(dev, 0, MII_BMSR);
-	bmcr = wrn_phy_read(dev, 0, MII_BMCR);
+	for (i = 0; i < EP_RMON_RAM_WORDS; i++) {
+		val = readl(&ep->ep_regs->RMON_RAM[i]);
+		ep->rmon[i] += (u32)(val - ep->rmon_last[i]);
+		ep->rmon_last[i] = val;
+	}
+}
 
-	//netdev_dbg(dev, "%s: read %x %x", __func__, bmsr, bmcr);
-//	printk("%s: read %x %x %x\n", __func__, bmsr, bmcr);
+static void __wrn_ep_rmon_reset(struct wrn_ep *ep)
+{
+	__wrn_ep_rmon_update(ep);
+	memset(ep->rmon_last, 0, sizeof(ep->rmon_last));
+}
 
-		/* Link wnt down? */
-	if (!mii_link_ok(&ep->mii)) {	
-		if(netif_carrier_ok(dev)) {
-			netif_carrier_off(dev);
-			clear_bit(WRN_EP_UP, &ep->ep_flags);
-			printk(KERN_INFO "%s: Link down.\n", dev->name);
-			return;
+/*
+ * Register snapshots, for ethtool -d and PRIV_IOCREADREGS: ep->lock keeps
+ * the counter reset out, and interrupts are off, so the pass isn't split.
+ * Offsets are checked by the caller.
+ */
+void wrn_ep_read_regs(struct wrn_ep *ep, const u32 *off, int n, u32 *val)
+{
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&ep->lock, flags);
+	for (i = 0; i < n; i++)
+		val[i] = readl((void *)ep->ep_regs + off[i]);
+	spin_unlock_irqrestore(&ep->lock, flags);
+}
+
+int wrn_ep_regs_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+	struct wrn_regs_req *req;
+	int i, err = 0;
+
+	req = kmalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+	if (copy_from_user(req, rq->ifr_data, sizeof(*req))) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	switch (req->cmd) {
+	case WRN_REGS_ALL:
+		req->offset = 0;
+		req->n = WRN_REGS_MAX;
+		/* fall through */
+	case WRN_REGS_RANGE:
+		if (req->n > WRN_REGS_MAX || req->offset & 3
+		    || req->offset > sizeof(struct EP_WB)
+		    || req->offset + req->n * 4 > sizeof(struct EP_WB)) {
+			err = -EINVAL;
+			goto out;
 		}
-		return;
+		for (i = 0; i < req->n; i++)
+			req->off[i] = req->offset + i * 4;
+		break;
+	case WRN_REGS_LIST:
+		if (req->n > WRN_REGS_MAX) {
+			err = -EINVAL;
+			goto out;
+		}
+		for (i = 0; i < req->n; i++)
+			if (req->off[i] >= sizeof(struct EP_WB)
+			    || req->off[i] & 3) {
+				err = -EINVAL;
+				goto out;
+			}
+		break;
+	default:
+		err = -EINVAL;
+		goto out;
 	}
 
-	/* Currently the link is active */
-	if(netif_carrier_ok(dev)) {
-		/* Software already knows it's up */
-		return;
+	wrn_ep_read_regs(ep, req->off, req->n, req->val);
+	if (copy_to_user(rq->ifr_data, req, sizeof(*req)))
+		err = -EFAULT;
+out:
+	kfree(req);
+	return err;
+}
+
+static void wrn_rmon_work(struct work_struct *work)
+{
+	struct wrn_dev *wrn = container_of(to_delayed_work(work),
+					   struct wrn_dev, rmon_work);
+	struct wrn_ep *ep;
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < WRN_NR_ENDPOINTS; i++) {
+		if (!wrn->dev[i])
+			continue;
+		ep = netdev_priv(wrn->dev[i]);
+		spin_lock_irqsave(&ep->lock, flags);
+		__wrn_ep_rmon_update(ep);
+		spin_unlock_irqrestore(&ep->lock, flags);
 	}
+	schedule_delayed_work(&wrn->rmon_work, WRN_RMON_INTERVAL);
+}
+
+void wrn_rmon_init(struct wrn_dev *wrn)
+{
+	INIT_DELAYED_WORK(&wrn->rmon_work, wrn_rmon_work);
+	schedule_delayed_work(&wrn->rmon_work, WRN_RMON_INTERVAL);
+}
+
+void wrn_rmon_exit(struct wrn_dev *wrn)
+{
+	cancel_delayed_work_sync(&wrn->rmon_work);
+}
+
+/* Read the same register from n endpoints, overlapping the transfers */
+static void __wrn_phy_read_all(struct wrn_ep **eps, int n, int location,
+			       u32 *val)
+{
+	int i;
 
-	/* What follows is the bring-up step */
+	for (i = 0; i < n; i++)
+		__wrn_phy_start_read(eps[i], location);
+	for (i = 0; i < n; i++)
+		val[i] = __wrn_phy_end_read(eps[i]);
+}
+
+/* The bring-up step, once the PCS reports link -- called with mdio_mutex */
+static int wrn_ep_link_up(struct wrn_ep *ep, u32 bmsr, u32 bmcr)
+{
+	struct net_device *dev = ep->mii.dev;
+	unsigned long flags;
+	u32 ecr, lpa;
+
+	if (!(bmsr & BMSR_LSTATUS))
+		return 0;
 
 	if (bmcr & BMCR_ANENABLE) { /* AutoNegotiation is enabled */
 		if (!(bmsr & BMSR_ANEGCOMPLETE)) {
-			/* Wait next timer, until it completes */
-			return;
+			/* Wait next poll, until it completes */
+			return 0;
 		}
 
 		lpa  = wrn_phy_read(dev, 0, MII_LPA);
@@ -102,31 +302,90 @@ static void wrn_update_link_status(struct net_device *dev)
 	netif_carrier_on(dev);
 	set_bit(WRN_EP_UP, &ep->ep_flags);
 
-	/* reset RMON counters */
+	/* reset RMON counters, after saving them */
+	spin_lock_irqsave(&ep->lock, flags);
+	__wrn_ep_rmon_reset(ep);
 	ecr = wrn_ep_read(ep, ECR);
 	wrn_ep_write(ep, ECR, ecr | EP_ECR_RST_CNT);
 	wrn_ep_write(ep, ECR, ecr );
+	spin_unlock_irqrestore(&ep->lock, flags);
+	return 1;
 }
 
-/* Actual timer function. Takes the lock and calls above function */
-static void wrn_ep_check_link(unsigned long dev_id)
+/*
+ * One poller for all endpoints. The PCS link bit in DSR costs a single
+ * register read, so MDIO is only used for ports whose DSR disagrees with
+ * the carrier, and those reads are pipelined across ports. Link loss must
+ * be seen quickly for failover, so we only back off (doubling the interval
+ * up to WRN_LINK_POLL_MAX) while every link is down and nothing changes.
+ */
+static void wrn_link_work(struct work_struct *work)
 {
-	struct net_device *dev = (struct net_device *) dev_id;
-	struct wrn_ep *ep = netdev_priv(dev);
-	unsigned long flags;
+	struct wrn_dev *wrn = container_of(to_delayed_work(work),
+					   struct wrn_dev, link_work);
+	struct wrn_ep *eps[WRN_NR_ENDPOINTS];
+	u32 bmsr[WRN_NR_ENDPOINTS], bmcr[WRN_NR_ENDPOINTS];
+	struct net_device *dev;
+	struct wrn_ep *ep;
+	int i, n = 0, up = 0, changed = 0;
+
+	mutex_lock(&wrn->mdio_mutex);
+	for (i = 0; i < WRN_NR_ENDPOINTS; i++) {
+		if (!(dev = wrn->dev[i]))
+			continue;
+		ep = netdev_priv(dev);
+		if (!test_bit(WRN_EP_POLL_LINK, &ep->ep_flags))
+			continue;
+		if (wrn_ep_read(ep, DSR) & EP_DSR_LSTATUS) {
+			if (!netif_carrier_ok(dev))
+				eps[n++] = ep; /* going up: check the phy */
+			else
+				up++;
+			continue;
+		}
+		/* Link went down? */
+		if (netif_carrier_ok(dev)) {
+			netif_carrier_off(dev);
+			clear_bit(WRN_EP_UP, &ep->ep_flags);
+			printk(KERN_INFO "%s: Link down.\n", dev->name);
+			changed = 1;
+		}
+	}
 
-	spin_lock_irqsave(&ep->lock, flags);
-	wrn_update_link_status(dev);
-	spin_unlock_irqrestore(&ep->lock, flags);
+	/* BMSR twice, as link status is latched-low */
+	__wrn_phy_read_all(eps, n, MII_BMSR, bmsr);
+	__wrn_phy_read_all(eps, n, MII_BMSR, bmsr);
+	__wrn_phy_read_all(eps, n, MII_BMCR, bmcr);
+	for (i = 0; i < n; i++)
+		changed |= wrn_ep_link_up(eps[i], bmsr[i], bmcr[i]);
+	mutex_unlock(&wrn->mdio_mutex);
+
+	/* Poll quickly if any link is up or in transition */
+	if (changed || n || up)
+		wrn->link_interval = WRN_LINK_POLL_INTERVAL;
+	else
+		wrn->link_interval = min_t(unsigned long, wrn->link_interval * 2,
+					 WRN_LINK_POLL_MAX);
+	schedule_delayed_work(&wrn->link_work, wrn->link_interval);
+}
+
+void wrn_link_init(struct wrn_dev *wrn)
+{
+	INIT_DELAYED_WORK(&wrn->link_work, wrn_link_work);
+	wrn->link_interval = WRN_LINK_POLL_INTERVAL;
+	schedule_delayed_work(&wrn->link_work, wrn->link_interval);
+}
 
-	mod_timer(&ep->ep_link_timer, jiffies + WRN_LINK_POLL_INTERVAL);
+void wrn_link_exit(struct wrn_dev *wrn)
+{
+	cancel_delayed_work_sync(&wrn->link_work);
 }
 
-/* Endpoint open and close turn on and off the timer */
+/* Endpoint open and close turn on and off link polling */
 int wrn_ep_open(struct net_device *dev)
 {
 	struct wrn_ep *ep = netdev_priv(dev);
-	unsigned long timerarg = (unsigned long)dev;
+	struct wrn_dev *wrn = ep->wrn;
 
 	/* Prepare hardware registers: first config, then bring up */
 	writel(0
@@ -141,6 +400,9 @@ int wrn_ep_open(struct net_device *dev)
 	 */
 	writel(EP_TSCR_EN_TXTS| EP_TSCR_EN_RXTS, &ep->ep_regs->TSCR);
 
+	spin_lock_irq(&ep->lock);
+	__wrn_ep_rmon_reset(ep); /* RST_CNT below */
+	spin_unlock_irq(&ep->lock);
 	writel(0
 	       | EP_ECR_PORTID_W(ep->ep_number)
 	       | EP_ECR_RST_CNT
@@ -151,15 +413,19 @@ int wrn_ep_open(struct net_device *dev)
 	/* Setup DMCR */
 	writel(0
 	       | EP_DMCR_EN
-	       | EP_DMCR_N_AVG_W(256 /* DMTD_AVG_SAMPLES */),
+	       | EP_DMCR_N_AVG_W(ep->dmtd_avg),
 	       &ep->ep_regs->DMCR);
 
+	mutex_lock(&wrn->mdio_mutex);
 	wrn_phy_write(dev, 0, MII_LPA, 0);
 	wrn_phy_write(dev, 0, MII_BMCR, BMCR_ANENABLE | BMCR_ANRESTART);
 
-	/* Prepare the timer for link-up notifications */
-	setup_timer(&ep->ep_link_timer, wrn_ep_check_link, timerarg);
-	mod_timer(&ep->ep_link_timer, jiffies + WRN_LINK_POLL_INTERVAL);
+	/* Have the poller look at us soon, for link-up notifications */
+	set_bit(WRN_EP_POLL_LINK, &ep->ep_flags);
+	wrn->link_interval = WRN_LINK_POLL_INTERVAL;
+	cancel_delayed_work(&wrn->link_work);
+	schedule_delayed_work(&wrn->link_work, WRN_LINK_POLL_INTERVAL);
+	mutex_unlock(&wrn->mdio_mutex);
 	return 0;
 }
 
@@ -167,8 +433,11 @@ int wrn_ep_close(struct net_device *dev)
 {
 	struct wrn_ep *ep = netdev_priv(dev);
 
+	/* Taking the mutex ensures the poller is not using this ep */
+	mutex_lock(&ep->wrn->mdio_mutex);
+	clear_bit(WRN_EP_POLL_LINK, &ep->ep_flags);
+	mutex_unlock(&ep->wrn->mdio_mutex);
 	writel(0, &ep->ep_regs->ECR);
-	del_timer_sync(&ep->ep_link_timer);
 	return 0;
 }
 
@@ -204,7 +473,9 @@ int wrn_endpoint_probe(struct net_device *dev)
 	dev_alloc_name(dev, "wr%d");
 	wrn_netops_init(dev); /* function in ./nic-core.c */
 	wrn_ethtool_init(dev); /* function in ./ethtool.c */
-	/* Napi is not supported on this device */
+	/* Napi is per-device, not per-endpoint: see wrn_poll() */
+
+	ep->dmtd_avg = WRN_DMTD_AVG_SAMPLES; /* see dmtd.c */
 
 	ep->mii.dev = dev;		/* Support for ethtool */
 	ep->mii.mdio_read = wrn_phy_read;
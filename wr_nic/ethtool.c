@@ -17,6 +17,7 @@
 #include <linux/mii.h>
 #include <linux/ethtool.h>
 #include <linux/spinlock.h>
+#include <linux/net_tstamp.h>
 
 #include "wr-nic.h"
 
@@ -25,9 +26,9 @@ static int wrn_get_settings(struct net_device *dev, struct ethtool_cmd *cmd)
 	struct wrn_ep *ep = netdev_priv(dev);
 	int ret;
 
-	spin_lock_irq(&ep->lock);
+	mutex_lock(&ep->wrn->mdio_mutex);
 	ret = mii_ethtool_gset(&ep->mii, cmd);
-	spin_unlock_irq(&ep->lock);
+	mutex_unlock(&ep->wrn->mdio_mutex);
 
 	cmd->supported=
 		SUPPORTED_FIBRE | /* FIXME: copper sfp? */
@@ -48,9 +49,9 @@ static int wrn_set_settings(struct net_device *dev, struct ethtool_cmd *cmd)
 	struct wrn_ep *ep = netdev_priv(dev);
 	int ret;
 
-	spin_lock_irq(&ep->lock);
+	mutex_lock(&ep->wrn->mdio_mutex);
 	ret = mii_ethtool_sset(&ep->mii, cmd);
-	spin_unlock_irq(&ep->lock);
+	mutex_unlock(&ep->wrn->mdio_mutex);
 
 	return ret;
 }
@@ -60,9 +61,9 @@ static int wrn_nwayreset(struct net_device *dev)
 	struct wrn_ep *ep = netdev_priv(dev);
 	int ret;
 
-	spin_lock_irq(&ep->lock);
+	mutex_lock(&ep->wrn->mdio_mutex);
 	ret = mii_nway_restart(&ep->mii);
-	spin_unlock_irq(&ep->lock);
+	mutex_unlock(&ep->wrn->mdio_mutex);
 
 	return ret;
 }
@@ -76,10 +77,164 @@ static void wrn_get_drvinfo(struct net_device *dev,
 		sizeof(info->bus_info));
 }
 
+/* Rings are shared by all endpoints and fixed in the gateware */
+static void wrn_get_ringparam(struct net_device *dev,
+			      struct ethtool_ringparam *ring)
+{
+	ring->tx_max_pending = WRN_NR_TXDESC;
+	ring->rx_max_pending = WRN_NR_RXDESC;
+	ring->tx_pending = WRN_NR_TXDESC;
+	ring->rx_pending = WRN_NR_RXDESC;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,5,0) /* get_ts_info */
+static int wrn_get_ts_info(struct net_device *dev,
+			   struct ethtool_ts_info *info)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+
+	info->so_timestamping =
+		SOF_TIMESTAMPING_TX_HARDWARE |
+		SOF_TIMESTAMPING_RX_HARDWARE |
+		SOF_TIMESTAMPING_RAW_HARDWARE |
+		SOF_TIMESTAMPING_RX_SOFTWARE |
+		SOF_TIMESTAMPING_SOFTWARE;
+	info->phc_index = wrn_ptp_index(ep->wrn);
+	info->tx_types = (1 << HWTSTAMP_TX_OFF) | (1 << HWTSTAMP_TX_ON);
+	info->rx_filters = (1 << HWTSTAMP_FILTER_NONE)
+		| (1 << HWTSTAMP_FILTER_ALL);
+	return 0;
+}
+#endif
+
+/* RMON counters: names from endpoint-regs.wb, the rest is undocumented */
+static const char wrn_rmon_names[EP_RMON_RAM_WORDS][ETH_GSTRING_LEN] = {
+	"tx_pcs_underruns",
+	"rx_pcs_invalid_codes",
+	"rx_pcs_sync_lost",
+	"rx_pcs_overruns",
+	"rx_crc_errors",
+	"rx_valid_frames",
+	"rx_runt_frames",
+	"rx_giant_frames",
+	"rx_pcs_errors",
+	"rx_dropped_frames",
+	"rmon_10", "rmon_11", "rmon_12", "rmon_13", "rmon_14", "rmon_15",
+	"rmon_16", "rmon_17", "rmon_18", "rmon_19", "rmon_20", "rmon_21",
+	"rmon_22", "rmon_23", "rmon_24", "rmon_25", "rmon_26", "rmon_27",
+	"rmon_28", "rmon_29", "rmon_30", "rmon_31",
+};
+
+/* Then software counters not in rtnl_link_stats64 */
+static const char wrn_sw_names[][ETH_GSTRING_LEN] = {
+	"tx_desc_full",
+	"rx_alloc_fail",
+	"rx_filtered",
+	"rx_no_oob", /* for the whole device, no port is known */
+};
+
+static int wrn_get_sset_count(struct net_device *dev, int sset)
+{
+	switch (sset) {
+	case ETH_SS_STATS:
+		return EP_RMON_RAM_WORDS + ARRAY_SIZE(wrn_sw_names);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void wrn_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+	if (sset != ETH_SS_STATS)
+		return;
+	memcpy(data, wrn_rmon_names, sizeof(wrn_rmon_names));
+	memcpy(data + sizeof(wrn_rmon_names), wrn_sw_names,
+	       sizeof(wrn_sw_names));
+}
+
+/* No MMIO here: RMON values come from the periodic snapshot */
+static void wrn_get_ethtool_stats(struct net_device *dev,
+				  struct ethtool_stats *stats, u64 *data)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+	struct wrn_dev *wrn = ep->wrn;
+	unsigned int start;
+
+	spin_lock_irq(&ep->lock);
+	memcpy(data, ep->rmon, sizeof(ep->rmon));
+	spin_unlock_irq(&ep->lock);
+	data += EP_RMON_RAM_WORDS;
+
+	spin_lock_irq(&wrn->lock); /* tx counters: see wrn_get_stats64 */
+	data[0] = ep->tx_stats.desc_full;
+	spin_unlock_irq(&wrn->lock);
+	do {
+		start = u64_stats_fetch_begin_bh(&ep->rx_stats.syncp);
+		data[1] = ep->rx_stats.alloc_fail;
+		data[2] = ep->rx_stats.filtered;
+	} while (u64_stats_fetch_retry_bh(&ep->rx_stats.syncp, start));
+	do {
+		start = u64_stats_fetch_begin_bh(&wrn->rx_syncp);
+		data[3] = wrn->rx_no_oob;
+	} while (u64_stats_fetch_retry_bh(&wrn->rx_syncp, start));
+}
+
+/* Coalescing is per device, as all endpoints share the same rings */
+static int wrn_get_coalesce(struct net_device *dev,
+			    struct ethtool_coalesce *ec)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+	struct wrn_dev *wrn = ep->wrn;
+
+	ec->rx_coalesce_usecs = wrn->rx_usecs;
+	ec->rx_max_coalesced_frames = wrn->rx_frames;
+	ec->tx_coalesce_usecs = wrn->tx_usecs;
+	ec->tx_max_coalesced_frames = wrn->tx_frames;
+	return 0;
+}
+
+static int wrn_set_coalesce(struct net_device *dev,
+			    struct ethtool_coalesce *ec)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+	struct wrn_dev *wrn = ep->wrn;
+
+	if (ec->rx_coalesce_usecs > WRN_COAL_MAX_USECS
+	    || ec->tx_coalesce_usecs > WRN_COAL_MAX_USECS
+	    || ec->rx_max_coalesced_frames > WRN_NR_RXDESC
+	    || ec->tx_max_coalesced_frames > WRN_NR_TXDESC)
+		return -EINVAL;
+
+	/* Read locklessly by the interrupt handler: any value is fine */
+	wrn->rx_usecs = ec->rx_coalesce_usecs;
+	wrn->rx_frames = ec->rx_max_coalesced_frames;
+	wrn->tx_usecs = ec->tx_coalesce_usecs;
+	wrn->tx_frames = ec->tx_max_coalesced_frames;
+	return 0;
+}
+
+/* The whole endpoint register block, read in one pass */
+static int wrn_get_regs_len(struct net_device *dev)
+{
+	return sizeof(struct EP_WB);
+}
+
+static void wrn_get_regs(struct net_device *dev, struct ethtool_regs *regs,
+			 void *data)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+	u32 off[WRN_REGS_MAX];
+	int i;
+
+	regs->version = 0;
+	for (i = 0; i < WRN_REGS_MAX; i++)
+		off[i] = i * 4;
+	wrn_ep_read_regs(ep, off, WRN_REGS_MAX, data);
+}
+
 /*
- * These are the operations we support. No coalescing is there since
- * most of the traffic will just happen within the FPGA switching core.
- * Similarly, other funcionality like ringparam are not used.
+ * These are the operations we support. Coalescing is only useful for
+ * the traffic that reaches the CPU, most of it stays in the switching core.
  * get_eeprom/set_eeprom may be useful for a simple MAC address management.
  */
 static const struct ethtool_ops wrn_ethtool_ops = {
@@ -87,9 +242,19 @@ static const struct ethtool_ops wrn_ethtool_ops = {
 	.set_settings	= wrn_set_settings,
 	.get_drvinfo	= wrn_get_drvinfo,
 	.nway_reset	= wrn_nwayreset,
+	.get_ringparam	= wrn_get_ringparam,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,5,0)
+	.get_ts_info	= wrn_get_ts_info,
+#endif
+	.get_coalesce	= wrn_get_coalesce,
+	.set_coalesce	= wrn_set_coalesce,
+	.get_sset_count	= wrn_get_sset_count,
+	.get_strings	= wrn_get_strings,
+	.get_ethtool_stats = wrn_get_ethtool_stats,
+	.get_regs_len	= wrn_get_regs_len,
+	.get_regs	= wrn_get_regs,
 	/* Some of the default methods apply for us */
 	.get_link	= ethtool_op_get_link,
-	/* FIXME: get_regs_len and get_regs may be useful for debugging */
 };
 
 int wrn_ethtool_init(struct net_device *netdev)
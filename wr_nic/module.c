@@ -67,6 +67,9 @@ int __init wrn_init(void)
 
 	/* A few fields must be initialized at run time */
 	spin_lock_init(&wrn_dev.lock);
+	mutex_init(&wrn_dev.mdio_mutex);
+	wrn_dev.frame_max = WRN_MTU;
+	wrn_dev.desc_size = WRN_DESC_SIZE(WRN_MTU);
 
 	platform_device_register(&wrn_device);
 	platform_driver_register(&wrn_driver);
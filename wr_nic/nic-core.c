@@ -12,11 +12,14 @@
  */
 
 #include <linux/kernel.h>
+#include <linux/moduleparam.h>
 #include <linux/netdevice.h>
 #include <linux/etherdevice.h>
 #include <linux/errno.h>
 #include <linux/spinlock.h>
 #include <linux/net_tstamp.h>
+#include <linux/highmem.h>
+#include <linux/hash.h>
 #include <asm/unaligned.h>
 
 #include "wr-nic.h"
@@ -27,11 +30,21 @@
  * They act on the _endpoint_ (as each Linux interface is one endpoint)
  * so sometimes a call to something within ./endpoint.c is performed.
  */
-static int wrn_open(struct net_device *dev)
+/* The MRU is a frame length, so it includes headers and the VLAN tag */
+static void wrn_set_mru(struct net_device *dev)
 {
 	struct wrn_ep *ep = netdev_priv(dev);
 	u32 val;
 
+	val = readl(&ep->ep_regs->RFCR) & ~EP_RFCR_MRU_MASK;
+	val |= EP_RFCR_MRU_W(WRN_FRAME_LEN(dev->mtu));
+	writel(val, &ep->ep_regs->RFCR);
+}
+
+static int wrn_open(struct net_device *dev)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+
 	/* This is "open" just for an endpoint. The nic hw is already on */
 	//netdev_dbg(dev, "%s\n", __func__);
 
@@ -43,15 +56,10 @@ static int wrn_open(struct net_device *dev)
 	wrn_ep_open(dev);
 
 	/* Software-only management is in this file*/
-	if (netif_queue_stopped(dev)) {
-		netif_wake_queue(dev);
-	} else {
-		netif_start_queue(dev);
-	}
+	wrn_ep_reset_txq(dev);
+	netif_tx_start_all_queues(dev);
 
-	/* Set the MRU equal to the MTU */
-	val = readl(&ep->ep_regs->RFCR) & ~EP_RFCR_MRU_MASK;
-	writel (val | EP_RFCR_MRU_W(dev->mtu), &ep->ep_regs->RFCR);
+	wrn_set_mru(dev);
 
 	/* Most drivers call platform_set_drvdata() but we don't need it */
 	return 0;
@@ -66,12 +74,138 @@ static int wrn_close(struct net_device *dev)
 		return ret;
 
 	/* FIXME: software-only fixing at close time */
-	netif_stop_queue(dev);
+	netif_tx_stop_all_queues(dev);
+	wrn_ep_reset_txq(dev);
 	netif_carrier_off(dev);
 	clear_bit(WRN_EP_UP, &ep->ep_flags);
 	return 0;
 }
 
+/*
+ * Drop frames still in the software queues and restart BQL accounting.
+ * Frames already in the ring belong to the previous generation, so their
+ * completion is not reported (see wrn_tx_complete).
+ */
+void wrn_ep_reset_txq(struct net_device *dev)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+	struct wrn_dev *wrn = ep->wrn;
+	struct sk_buff_head list;
+	unsigned long flags;
+	int q;
+
+	__skb_queue_head_init(&list);
+	spin_lock_irqsave(&wrn->lock, flags);
+	for (q = 0; q < WRN_NR_TXQ; q++) {
+		skb_queue_splice_tail_init(&ep->txq[q], &list);
+		netdev_tx_reset_queue(netdev_get_tx_queue(dev, q));
+	}
+	ep->deficit = 0;
+	ep->txq_gen++;
+	spin_unlock_irqrestore(&wrn->lock, flags);
+	__skb_queue_purge(&list);
+}
+
+/*
+ * Rx slots are shared by all endpoints, so they are sized for the largest
+ * mtu among them; changing it reconfigures the rings. All 8 rx slots and
+ * one tx buffer must fit in packet memory (WRN_FRAME_FITS), which bounds
+ * the mtu. Called under rtnl, so changes don't race.
+ */
+static int wrn_change_mtu(struct net_device *dev, int new_mtu)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+	struct wrn_dev *wrn = ep->wrn;
+	int i, mtu, frame = 0, err;
+
+	if (new_mtu < WRN_MIN_MTU || WRN_FRAME_LEN(new_mtu) > WRN_MAX_FRAME)
+		return -EINVAL;
+
+	for (i = 0; i < WRN_NR_ENDPOINTS; i++) {
+		if (!wrn->dev[i])
+			continue;
+		mtu = wrn->dev[i] == dev ? new_mtu : wrn->dev[i]->mtu;
+		frame = max(frame, WRN_FRAME_LEN(mtu));
+	}
+	frame = max(frame, WRN_MTU); /* never below the default slot */
+	if (frame != wrn->frame_max) {
+		err = wrn_set_rings(wrn, frame);
+		if (err)
+			return err;
+	}
+
+	dev->mtu = new_mtu;
+	if (netif_running(dev))
+		wrn_set_mru(dev);
+	return 0;
+}
+
+/*
+ * Address filtering. The endpoints have no address filter and the RTU
+ * forwards to the CPU port whatever is not learnt elsewhere, so we filter
+ * in software, but before the frame is copied out of packet memory.
+ * Secondary unicast and multicast addresses share a 64-bit hash, which
+ * may let some unwanted frames in: the stack drops them later.
+ * The PTP addresses always pass, as before the filter: ptp daemons using
+ * raw sockets don't join them, and need them even without /dev/wr-ptp.
+ */
+static const u8 wrn_ptp_mc[][ETH_ALEN] = {
+	{0x01, 0x1b, 0x19, 0x00, 0x00, 0x00}, /* IEEE 1588 over L2 */
+	{0x01, 0x80, 0xc2, 0x00, 0x00, 0x0e}, /* peer delay */
+};
+
+static inline int __wrn_rx_hash(const u8 *mac)
+{
+	u32 val = get_unaligned_be16(mac) ^ get_unaligned_be32(mac + 2);
+
+	return hash_32(val, WRN_RX_HASH_BITS);
+}
+
+static int __wrn_rx_wanted(struct net_device *dev, const u8 *da)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+
+	if (test_bit(WRN_EP_RX_PROMISC, &ep->ep_flags))
+		return 1;
+	if (is_multicast_ether_addr(da)) {
+		if (is_broadcast_ether_addr(da)
+		    || test_bit(WRN_EP_RX_ALLMULTI, &ep->ep_flags)
+		    || ether_addr_equal(da, wrn_ptp_mc[0])
+		    || ether_addr_equal(da, wrn_ptp_mc[1]))
+			return 1;
+	} else if (ether_addr_equal(da, dev->dev_addr)) {
+		return 1;
+	}
+	return (ep->rx_hash >> __wrn_rx_hash(da)) & 1;
+}
+
+/*
+ * Called with the address lock held, while napi may be filtering: a frame
+ * racing with the update may be judged by the old rules, like it happens
+ * with hardware filters.
+ */
+static void wrn_set_rx_mode(struct net_device *dev)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+	struct netdev_hw_addr *ha;
+	u64 hash = 0;
+
+	netdev_for_each_uc_addr(ha, dev)
+		hash |= 1ULL << __wrn_rx_hash(ha->addr);
+	netdev_for_each_mc_addr(ha, dev)
+		hash |= 1ULL << __wrn_rx_hash(ha->addr);
+	ep->rx_hash = hash;
+
+	if (dev->flags & IFF_PROMISC)
+		set_bit(WRN_EP_RX_PROMISC, &ep->ep_flags);
+	else
+		clear_bit(WRN_EP_RX_PROMISC, &ep->ep_flags);
+	if (dev->flags & IFF_ALLMULTI)
+		set_bit(WRN_EP_RX_ALLMULTI, &ep->ep_flags);
+	else
+		clear_bit(WRN_EP_RX_ALLMULTI, &ep->ep_flags);
+}
+
 static int wrn_set_mac_address(struct net_device *dev, void* vaddr)
 {
 	struct wrn_ep *ep = netdev_priv(dev);
@@ -95,14 +229,13 @@ static int wrn_set_mac_address(struct net_device *dev, void* vaddr)
 	return 0;
 }
 
-/* Next descriptor */
-static int __wrn_next_desc(int i)
-{
-	return (i+1) % WRN_NR_DESC;
-}
-
-/* This is called with the lock taken */
-static int __wrn_alloc_tx_desc(struct wrn_dev *wrn)
+/*
+ * Allocate a descriptor and its buffer. Return the descriptor number,
+ * and the buffer offset in *offset. This is called with the lock taken.
+ * The descriptor is only counted in tx_inflight when fired, so tx-done
+ * doesn't look at it while the frame is copied (see wrn_tx_schedule).
+ */
+static int __wrn_alloc_tx_desc(struct wrn_dev *wrn, int len, int *offset)
 {
 	int ret = wrn->next_tx_head;
 	struct wrn_txd __iomem *tx;
@@ -110,34 +243,60 @@ static int __wrn_alloc_tx_desc(struct wrn_dev *wrn)
 	tx = wrn->txd + ret;
 
 	/* Check if it's available */
-	if (readl(&tx->tx1) & NIC_TX1_D1_READY) {
+	if (wrn->tx_inflight == WRN_NR_TXDESC
+	    || readl(&tx->tx1) & NIC_TX1_D1_READY) {
 		pr_debug("%s: not free %i\n", __func__, ret);
 		return -ENOMEM;
 	}
-	wrn->next_tx_head = __wrn_next_desc(ret);
+	*offset = __wrn_tx_buf_alloc(wrn, len);
+	if (*offset < 0) {
+		pr_debug("%s: no buffer for %i bytes\n", __func__, len);
+		return -ENOMEM;
+	}
+	wrn->skb_desc[ret].buf_end = wrn->txbuf_head;
+	wrn->next_tx_head = __wrn_next_txdesc(wrn, ret);
 	return ret;
 }
 
-/* Actual transmission over a single endpoint */
-static void __wrn_tx_desc(struct wrn_ep *ep, int desc,
-			  void *data, int len, int id, int do_stamp)
+/*
+ * The frame goes to the port it was sent on, unless the sender asked for
+ * a group of ports through skb->mark (see WRN_MARK_PORTMASK in wr-nic.h):
+ * the NIC then sends the single copy we write to all of them.
+ * Ports that don't exist or are down are removed from the mask.
+ */
+static bool mark_portmask;
+module_param(mark_portmask, bool, S_IRUGO);
+MODULE_PARM_DESC(mark_portmask, "Use skb->mark as a tx port mask (bit 31)");
+
+static u32 __wrn_tx_portmask(struct wrn_dev *wrn, struct wrn_ep *ep,
+			     struct sk_buff *skb)
 {
-	struct wrn_dev *wrn = ep->wrn;
-	int offset = __wrn_desc_offset(wrn, WRN_DDIR_TX, desc);
-	u32 *ptr = __wrn_desc_mem(wrn, WRN_DDIR_TX, desc);
-	struct wrn_txd __iomem *tx = wrn->txd + desc;
+	u32 mask, valid = 0;
+	int i;
 
-	/* data */
-	pr_debug("%s: %i -- data %p, len %i ", __func__, __LINE__,
-	       data, len);
-	pr_debug("-- desc %i (tx %p)\n", desc, tx);
+	if (!mark_portmask || !(skb->mark & WRN_MARK_PORTMASK))
+		return 1 << ep->ep_number;
+	/* A tx stamp can only refer to one port: don't fan out */
+	if (skb_shinfo(skb)->tx_flags & SKBTX_HW_TSTAMP)
+		return 1 << ep->ep_number;
+
+	for (i = 0; i < WRN_NR_ENDPOINTS; i++)
+		if (wrn->dev[i] && netif_running(wrn->dev[i]))
+			valid |= 1 << i;
+	mask = skb->mark & WRN_MARK_PORTS & valid;
+	return mask ? mask : 1 << ep->ep_number;
+}
 
-	__wrn_copy_out(ptr, data, len);
+/* Fire a descriptor whose data is already in packet memory (lock taken) */
+static void __wrn_tx_fire(struct wrn_dev *wrn, int desc, int offset,
+			  int len, int id, int do_stamp, u32 portmask)
+{
+	struct wrn_txd __iomem *tx = wrn->txd + desc;
 
-	/* TX register 3: mask of endpoints (FIXME: broadcast) */
-	//printk("EP Num: %d\n", ep->ep_number);
+	wrn->tx_inflight++;
 
-	writel(1<<ep->ep_number, &tx->tx3);
+	/* TX register 3: mask of endpoints */
+	writel(portmask, &tx->tx3);
 
 	/* TX register 2: offset and length */
 	writel(offset | (len << 16), &tx->tx2);
@@ -148,75 +307,314 @@ static void __wrn_tx_desc(struct wrn_ep *ep, int desc,
 	       &tx->tx1);
 }
 
+/* Copy a frame to its reserved buffer. Called without the lock */
+static void wrn_tx_copy(struct wrn_dev *wrn, int desc, int offset,
+			struct sk_buff *skb)
+{
+	u32 __iomem *ptr = wrn->databuf + offset;
+
+	pr_debug("%s: %i -- data %p, len %i ", __func__, __LINE__,
+	       skb->data, skb->len);
+	pr_debug("-- desc %i\n", desc);
+
+	if (skb_is_nonlinear(skb))
+		__wrn_copy_out_skb(ptr, skb);
+	else
+		__wrn_copy_out(ptr, skb->data, skb->len);
+}
+
+/*
+ * Send a frame with no skb, for /dev/wr-ptp. It bypasses the software
+ * queues, so it goes out before anything the scheduler didn't send yet.
+ * Return the stamp id, or -EAGAIN if the ring is full, being rebuilt or
+ * another frame is being copied (wrn_tx_schedule() wakes pch_wait then).
+ */
+static void wrn_tx_schedule(struct wrn_dev *wrn);
 
-static int wrn_start_xmit(struct sk_buff *skb, struct net_device *dev)
+int wrn_tx_raw(struct wrn_dev *wrn, int port, void *data, int len,
+	       int do_stamp)
 {
-	struct wrn_ep *ep = netdev_priv(dev);
-	struct wrn_dev *wrn = ep->wrn;
-	struct skb_shared_info *info = skb_shinfo(skb);
+	struct wrn_ep *ep = netdev_priv(wrn->dev[port]);
 	unsigned long flags;
-	int desc;
-	int id;
-	int do_stamp = 0;
-	void *data; /* FIXME: move data and len to __wrn_tx_desc */
-	unsigned len;
+	int desc, offset, id;
 
-	if (unlikely(skb->len > WRN_MTU)) {
-		/* FIXME: check this WRN_MTU is needed and used properly */
-		ep->stats.tx_errors++;
-		return -EMSGSIZE;
+	local_bh_disable(); /* don't sleep while others wait for tx_copying */
+	spin_lock_irqsave(&wrn->lock, flags);
+	if (wrn->rings_busy || wrn->tx_copying)
+		desc = -EAGAIN;
+	else
+		desc = __wrn_alloc_tx_desc(wrn, len, &offset);
+	if (desc < 0) {
+		spin_unlock_irqrestore(&wrn->lock, flags);
+		local_bh_enable();
+		return -EAGAIN;
 	}
+	wrn->tx_copying = 1;
+	id = (wrn->id++) & 0xffff;
+	wrn->skb_desc[desc].skb = NULL;
+	wrn->skb_desc[desc].id = id;
+	spin_unlock_irqrestore(&wrn->lock, flags);
+
+	__wrn_copy_out(wrn->databuf + offset, data, len);
 
-	/* Allocate a descriptor and id (start from last allocated) */
 	spin_lock_irqsave(&wrn->lock, flags);
-	desc = __wrn_alloc_tx_desc(wrn);
-	id = (wrn->id++) & 0xffff;
+	__wrn_tx_fire(wrn, desc, offset, len, id, do_stamp, 1 << port);
+	wrn->tx_copying = 0;
+	u64_stats_update_begin(&ep->tx_stats.syncp);
+	ep->tx_stats.packets++;
+	ep->tx_stats.bytes += len;
+	u64_stats_update_end(&ep->tx_stats.syncp);
 	spin_unlock_irqrestore(&wrn->lock, flags);
 
-	if (desc < 0) /* error */
-		return desc;
+	/* Frames may have been queued while we were copying */
+	wrn_tx_schedule(wrn);
+	local_bh_enable();
+	return id;
+}
 
-	data = skb->data;
-	len = skb->len;
 
-	//spin_lock_irqsave(&ep->lock, flags);
+/*
+ * Reserve the hardware ring for one frame, which must have room for it.
+ * This is called with the lock taken, by the scheduler below.
+ */
+static int __wrn_tx_reserve(struct wrn_dev *wrn, struct wrn_ep *ep,
+			    struct sk_buff *skb, int *offset)
+{
+	int desc;
+
+	desc = __wrn_alloc_tx_desc(wrn, skb->len, offset);
+	if (WARN_ON(desc < 0)) { /* the scheduler checked before */
+		dev_kfree_skb_any(skb);
+		return desc;
+	}
 
 	if (wrn->skb_desc[desc].skb) {
 		pr_err("%s: descriptor overflow: tx timestamp pending\n",
 			__func__);
 	}
 	wrn->skb_desc[desc].skb = skb; /* Save for tx irq and stamping */
-	wrn->skb_desc[desc].id = id; /* Save for tx irq and stamping */
+	wrn->skb_desc[desc].id = (wrn->id++) & 0xffff; /* Same */
+	wrn->skb_desc[desc].gen = ep->txq_gen; /* Save for BQL */
+	return desc;
+}
 
-	//netif_stop_queue(dev); /* Queue stopped until tx is over (FIXME?) */
+/* Then, with the lock taken again after the copy, send it */
+static void __wrn_tx_commit(struct wrn_dev *wrn, struct wrn_ep *ep,
+			    int desc, int offset, struct sk_buff *skb)
+{
+	struct skb_shared_info *info = skb_shinfo(skb);
+	int do_stamp = 0;
 
 	/* FIXME: check the WRN_EP_STAMPING_TX flag and its meaning */
 	if (info->tx_flags & SKBTX_HW_TSTAMP) {
 		/* hardware timestamping is enabled */
 		do_stamp = 1;
 	}
-
-	/* This both copies the data to the descriptr and fires tx */
-	__wrn_tx_desc(ep, desc, data, len, id, do_stamp);
+	__wrn_tx_fire(wrn, desc, offset, skb->len, wrn->skb_desc[desc].id,
+		      do_stamp, __wrn_tx_portmask(wrn, ep, skb));
 
 	/* We are done, this is trivial maiintainance*/
-	ep->stats.tx_packets++;
-	ep->stats.tx_bytes += len;
-	dev->trans_start = jiffies;
+	u64_stats_update_begin(&ep->tx_stats.syncp);
+	ep->tx_stats.packets++;
+	ep->tx_stats.bytes += skb->len;
+	u64_stats_update_end(&ep->tx_stats.syncp);
+}
 
-	//spin_unlock_irqrestore(&ep->lock, flags);
-	return 0;
+/*
+ * The hardware tx ring is shared by all endpoints. Each endpoint has
+ * its own software queues, and this scheduler feeds the ring from them:
+ * PTP frames first (round-robin over endpoints), then the bulk queues
+ * with deficit round robin, so a chatty port can't starve the others.
+ */
+static struct wrn_ep *__wrn_tx_ep(struct wrn_dev *wrn, int i)
+{
+	return wrn->dev[i] ? netdev_priv(wrn->dev[i]) : NULL;
 }
 
-struct net_device_stats *wrn_get_stats(struct net_device *dev)
+static void __wrn_drr_advance(struct wrn_dev *wrn)
 {
-	struct wrn_ep *ep = netdev_priv(dev);
+	wrn->drr_next = (wrn->drr_next + 1) % WRN_NR_ENDPOINTS;
+	wrn->drr_granted = 0;
+}
+
+/* Pick the next frame to send, if the ring has room. Lock taken */
+static struct sk_buff *__wrn_tx_next(struct wrn_dev *wrn,
+				     struct wrn_ep **epp)
+{
+	struct wrn_ep *ep;
+	struct sk_buff *skb;
+	int i, idle;
+
+	if (wrn->rings_busy || __wrn_tx_full(wrn))
+		return NULL;
+
+	/* Strict priority for PTP */
+	for (idle = 0; idle < WRN_NR_ENDPOINTS; idle++) {
+		i = wrn->ptp_next;
+		wrn->ptp_next = (i + 1) % WRN_NR_ENDPOINTS;
+		ep = __wrn_tx_ep(wrn, i);
+		if (ep && (skb = __skb_dequeue(&ep->txq[WRN_TXQ_PTP]))) {
+			*epp = ep;
+			return skb;
+		}
+	}
 
-	/* FIXME: we should get the RMON information from endpoint */
-	return &ep->stats;
+	/* Deficit round robin for everything else */
+	for (idle = 0; idle < WRN_NR_ENDPOINTS; ) {
+		ep = __wrn_tx_ep(wrn, wrn->drr_next);
+		if (!ep || !(skb = skb_peek(&ep->txq[WRN_TXQ_BULK]))) {
+			if (ep)
+				ep->deficit = 0;
+			__wrn_drr_advance(wrn);
+			idle++;
+			continue;
+		}
+		idle = 0;
+		if (!wrn->drr_granted) {
+			ep->deficit += WRN_DRR_QUANTUM;
+			wrn->drr_granted = 1;
+		}
+		if (skb->len > ep->deficit) {
+			__wrn_drr_advance(wrn);
+			continue;
+		}
+		__skb_dequeue(&ep->txq[WRN_TXQ_BULK]);
+		ep->deficit -= skb->len;
+		*epp = ep;
+		return skb;
+	}
 	return NULL;
 }
 
+/*
+ * Feed the ring. The copy to packet memory is the longest part of tx, so
+ * it runs without the lock: the ring is reserved before and the frame is
+ * fired after. There is one copier at a time (tx_copying): whoever finds
+ * one at work leaves its frames to it, as it picks again before leaving.
+ * This is called from xmit, wrn_tx_raw() and the tx-done tasklet.
+ */
+static void wrn_tx_schedule(struct wrn_dev *wrn)
+{
+	struct wrn_ep *ep;
+	struct sk_buff *skb;
+	unsigned long flags;
+	int desc, offset;
+
+	spin_lock_irqsave(&wrn->lock, flags);
+	if (wrn->tx_copying) {
+		spin_unlock_irqrestore(&wrn->lock, flags);
+		return;
+	}
+	wrn->tx_copying = 1;
+	while ((skb = __wrn_tx_next(wrn, &ep))) {
+		desc = __wrn_tx_reserve(wrn, ep, skb, &offset);
+		if (desc < 0)
+			continue;
+		spin_unlock_irqrestore(&wrn->lock, flags);
+		wrn_tx_copy(wrn, desc, offset, skb);
+		spin_lock_irqsave(&wrn->lock, flags);
+		__wrn_tx_commit(wrn, ep, desc, offset, skb);
+	}
+	wrn->tx_copying = 0;
+	spin_unlock_irqrestore(&wrn->lock, flags);
+
+	/* wrn_tx_raw() may have given up because we were copying */
+	if (test_bit(0, &wrn->pch_busy))
+		wake_up_interruptible(&wrn->pch_wait);
+}
+
+/* PTP event frames (or anything asking for a stamp) go first */
+static u16 wrn_select_queue(struct net_device *dev, struct sk_buff *skb)
+{
+	if (skb->protocol == htons(ETH_P_1588)
+	    || skb_shinfo(skb)->tx_flags & SKBTX_HW_TSTAMP)
+		return WRN_TXQ_PTP;
+	return WRN_TXQ_BULK;
+}
+
+static netdev_tx_t wrn_start_xmit(struct sk_buff *skb, struct net_device *dev)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+	struct wrn_dev *wrn = ep->wrn;
+	u16 q = skb_get_queue_mapping(skb);
+	unsigned long flags;
+	int err = 0;
+
+	/*
+	 * We claim HW_CSUM so the stack sends fragments (SG needs it), but
+	 * the NIC computes nothing: do it here, reading the fragments in place.
+	 * This is a separate pass over the payload, where without HW_CSUM the
+	 * stack folds the checksum into its copy from user space.
+	 * wrn_bench_csum() in bench.c compares it with linearizing the frame.
+	 */
+	if (skb->ip_summed == CHECKSUM_PARTIAL)
+		err = skb_checksum_help(skb);
+
+	/* Tx counters are written under the lock: the two queues may race */
+	spin_lock_irqsave(&wrn->lock, flags);
+	if (unlikely(skb->len > WRN_FRAME_LEN(dev->mtu) || err)) {
+		u64_stats_update_begin(&ep->tx_stats.syncp);
+		ep->tx_stats.errors++;
+		u64_stats_update_end(&ep->tx_stats.syncp);
+		spin_unlock_irqrestore(&wrn->lock, flags);
+		dev_kfree_skb_any(skb);
+		return NETDEV_TX_OK;
+	}
+
+	/* Queue it, stop the queue if full, and let the scheduler run */
+	if (__wrn_tx_full(wrn)) {
+		u64_stats_update_begin(&ep->tx_stats.syncp);
+		ep->tx_stats.desc_full++;
+		u64_stats_update_end(&ep->tx_stats.syncp);
+	}
+	__skb_queue_tail(&ep->txq[q], skb);
+	netdev_tx_sent_queue(netdev_get_tx_queue(dev, q), skb->len);
+	if (skb_queue_len(&ep->txq[q]) >= WRN_TXQ_LEN)
+		netif_stop_subqueue(dev, q);
+	spin_unlock_irqrestore(&wrn->lock, flags);
+	wrn_tx_schedule(wrn);
+
+	dev->trans_start = jiffies;
+	return NETDEV_TX_OK;
+}
+
+/* Software counters, plus the RMON errors from the last snapshot */
+static struct rtnl_link_stats64 *wrn_get_stats64(struct net_device *dev,
+						struct rtnl_link_stats64 *st)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+	struct wrn_ep_stats tx, rx;
+	unsigned long flags;
+	unsigned int start;
+
+	/* Tx counters are written by xmit, tx-done and wr-ptp: take the lock */
+	spin_lock_irqsave(&ep->wrn->lock, flags);
+	tx = ep->tx_stats;
+	spin_unlock_irqrestore(&ep->wrn->lock, flags);
+	do {
+		start = u64_stats_fetch_begin_bh(&ep->rx_stats.syncp);
+		rx = ep->rx_stats;
+	} while (u64_stats_fetch_retry_bh(&ep->rx_stats.syncp, start));
+
+	st->tx_packets = tx.packets;
+	st->tx_bytes = tx.bytes;
+	st->tx_errors = tx.errors;
+	st->rx_packets = rx.packets;
+	st->rx_bytes = rx.bytes;
+	st->rx_dropped = rx.alloc_fail;
+
+	spin_lock_irqsave(&ep->lock, flags);
+	st->rx_crc_errors = ep->rmon[WRN_RMON_RX_CRC];
+	st->rx_length_errors = ep->rmon[WRN_RMON_RX_RUNT]
+		+ ep->rmon[WRN_RMON_RX_GIANT];
+	st->rx_fifo_errors = ep->rmon[WRN_RMON_RX_OVERRUN];
+	st->tx_fifo_errors = ep->rmon[WRN_RMON_TX_UNDERRUN];
+	spin_unlock_irqrestore(&ep->lock, flags);
+	st->rx_errors = st->rx_crc_errors + st->rx_length_errors
+		+ st->rx_fifo_errors;
+	return st;
+}
+
 static int wrn_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
 {
 	struct wrn_ep *ep = netdev_priv(dev);
@@ -230,6 +628,9 @@ static int wrn_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
 		return wrn_calib_ioctl(dev, rq, cmd);
 	case PRIV_IOCGGETPHASE:
 		return wrn_phase_ioctl(dev, rq, cmd);
+	case PRIV_IOCSCLASSIFY:
+	case PRIV_IOCGCLASSIFY:
+		return wrn_cls_ioctl(dev, rq, cmd);
 	case PRIV_IOCREADREG:
 		if (get_user(reg, (u32 *)rq->ifr_data) < 0)
 			return -EFAULT;
@@ -239,24 +640,31 @@ static int wrn_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
 		if (put_user(reg, (u32 *)rq->ifr_data) < 0)
 			return -EFAULT;
 		return 0;
+	case PRIV_IOCREADREGS:
+		return wrn_ep_regs_ioctl(dev, rq, cmd);
+	case PRIV_IOCSDMTDAVG:
+		return wrn_dmtd_avg_ioctl(dev, rq, cmd);
 	case PRIV_IOCPHYREG:
 		/* this command allows to read and write a phy register */
 		if (get_user(reg, (u32 *)rq->ifr_data) < 0)
 			return -EFAULT;
+		mutex_lock(&ep->wrn->mdio_mutex);
 		if (reg & (1<<31)) {
 			wrn_phy_write(dev, 0, (reg >> 16) & 0xff,
 				      reg & 0xffff);
+			mutex_unlock(&ep->wrn->mdio_mutex);
 			return 0;
 		}
-		reg = wrn_phy_read(dev, 0, (reg >> 16) & 0xff);
+		reg = wrn_phy_read_uncached(dev, (reg >> 16) & 0xff);
+		mutex_unlock(&ep->wrn->mdio_mutex);
 		if (put_user(reg, (u32 *)rq->ifr_data) < 0)
 			return -EFAULT;
 		return 0;
 
 	default:
-		spin_lock_irq(&ep->lock);
+		mutex_lock(&ep->wrn->mdio_mutex);
 		res = generic_mii_ioctl(&ep->mii, if_mii(rq), cmd, NULL);
-		spin_unlock_irq(&ep->lock);
+		mutex_unlock(&ep->wrn->mdio_mutex);
 		return res;
 	}
 }
@@ -265,42 +673,178 @@ static const struct net_device_ops wrn_netdev_ops = {
 	.ndo_open		= wrn_open,
 	.ndo_stop		= wrn_close,
 	.ndo_start_xmit		= wrn_start_xmit,
+	.ndo_select_queue	= wrn_select_queue,
 	.ndo_validate_addr	= eth_validate_addr,
-	.ndo_get_stats		= wrn_get_stats,
+	.ndo_get_stats64	= wrn_get_stats64,
 	.ndo_set_mac_address	= wrn_set_mac_address,
 	.ndo_do_ioctl		= wrn_ioctl,
-#if 0
-	/* Missing ops, possibly to add later */
-	.ndo_set_multicast_list	= wrn_set_multicast_list,
 	.ndo_change_mtu		= wrn_change_mtu,
+	.ndo_set_rx_mode	= wrn_set_rx_mode,
 	/* There are several more, but not really useful for us */
-#endif
 };
 
 
 int wrn_netops_init(struct net_device *dev)
 {
 	dev->netdev_ops = &wrn_netdev_ops;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,39)
+	dev->hw_features = NETIF_F_SG | NETIF_F_HW_CSUM;
+	dev->features |= dev->hw_features;
+#else
+	dev->features |= NETIF_F_SG | NETIF_F_HW_CSUM; /* not changeable */
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,0)
+	dev->priv_flags |= IFF_UNICAST_FLT; /* see wrn_set_rx_mode() */
+#endif
 	return 0;
 }
 
 /*
  * From this onwards, it's all about interrupt management
  */
-static void __wrn_rx_descriptor(struct wrn_dev *wrn, int desc)
+/*
+ * Rx buffers. Full-size skbs come from a pool that is refilled by a work
+ * item, so napi doesn't allocate big buffers under memory pressure; small
+ * frames are copied to a small, freshly allocated (and cache-hot) skb.
+ * Each falls back to the other, and if both fail the frame is dropped
+ * and counted by the caller.
+ * Pool skbs get the same headroom as netdev_alloc_skb_ip_align(): the copy
+ * writes WRN_DDATA_OFFSET bytes before skb->data, and forwarding may push.
+ */
+#define WRN_RX_SKB_PAD (NET_SKB_PAD + NET_IP_ALIGN)
+
+static void wrn_rx_refill(struct work_struct *work)
+{
+	struct wrn_dev *wrn = container_of(work, struct wrn_dev, rx_refill);
+	struct sk_buff *skb;
+
+	while (skb_queue_len(&wrn->rx_pool) < WRN_RX_POOL_SIZE) {
+		skb = alloc_skb(WRN_RX_SKB_PAD + WRN_RX_SKB_SIZE, GFP_KERNEL);
+		if (!skb)
+			break; /* napi will retry later */
+		skb_reserve(skb, WRN_RX_SKB_PAD);
+		skb_queue_tail(&wrn->rx_pool, skb);
+	}
+}
+
+static struct sk_buff *wrn_rx_skb(struct wrn_dev *wrn, struct net_device *dev,
+				  int len)
+{
+	struct sk_buff *skb = NULL;
+
+	/* Jumbo frames are larger than pool buffers: allocate them here */
+	if (len <= WRN_RX_COPYBREAK || len > WRN_RX_SKB_SIZE)
+		skb = netdev_alloc_skb_ip_align(dev, len);
+	if (!skb && len <= WRN_RX_SKB_SIZE)
+		skb = skb_dequeue(&wrn->rx_pool);
+	/* Pool empty (refill late): try a plain allocation before dropping */
+	if (!skb && len > WRN_RX_COPYBREAK && len <= WRN_RX_SKB_SIZE)
+		skb = netdev_alloc_skb_ip_align(dev, len);
+	if (skb_queue_len(&wrn->rx_pool) < WRN_RX_POOL_SIZE / 2)
+		schedule_work(&wrn->rx_refill);
+	if (skb)
+		skb->dev = dev;
+	return skb;
+}
+
+void wrn_rx_pool_init(struct wrn_dev *wrn)
+{
+	skb_queue_head_init(&wrn->rx_pool);
+	INIT_WORK(&wrn->rx_refill, wrn_rx_refill);
+	wrn_rx_refill(&wrn->rx_refill);
+}
+
+void wrn_rx_pool_exit(struct wrn_dev *wrn)
+{
+	cancel_work_sync(&wrn->rx_refill);
+	skb_queue_purge(&wrn->rx_pool);
+}
+
+/*
+ * The rx stamp only carries the tick counter: the seconds come from the
+ * PPS generator. Reading it is three or four MMIO accesses, so we read it
+ * once per rx batch, at the first frame that wants a stamp. A batch is
+ * much shorter than the quarter second used to detect the wrap, and
+ * frames later in the batch may be after the snapshot, so check both ways.
+ */
+struct wrn_timebase {
+	int valid;
+	u32 counter_ppsg; /* PPS generator nanosecond counter */
+	u32 utc;
+};
+
+static u32 __wrn_rx_utc(struct wrn_dev *wrn, struct wrn_timebase *tb,
+			u32 ts_r)
+{
+	if (!tb->valid) {
+		wrn_ppsg_read_time(wrn, &tb->counter_ppsg, &tb->utc);
+		tb->valid = 1;
+	}
+	if(tb->counter_ppsg < REFCLK_FREQ/4 && ts_r > 3*REFCLK_FREQ/4)
+		return tb->utc - 1;
+	if(tb->counter_ppsg > 3*REFCLK_FREQ/4 && ts_r < REFCLK_FREQ/4)
+		return tb->utc + 1;
+	return tb->utc;
+}
+
+static void __wrn_rx_stamp(struct wrn_dev *wrn, struct wrn_timebase *tb,
+			   u32 ts_r, u32 ts_f, struct timespec *ts)
+{
+	s32 cntr_diff;
+
+	ts->tv_sec = (s32)__wrn_rx_utc(wrn, tb, ts_r) & 0x7fffffff;
+	cntr_diff = (ts_r & 0xf) - ts_f;
+	/* the bit says the rising edge cnter is 1tick ahead */
+	if(cntr_diff == 1 || cntr_diff == (-0xf))
+		ts->tv_sec |= 0x80000000;
+	ts->tv_nsec = ts_r * NSEC_PER_TICK;
+}
+
+/* While /dev/wr-ptp is open, it gets PTP frames (see ptp-chan.c) */
+static int __wrn_rx_is_pch(struct wrn_dev *wrn, const u8 *hdr, int len)
+{
+	if (!test_bit(0, &wrn->pch_busy) || !wrn->pch_ring)
+		return 0;
+	return len <= WRN_PCH_FRAME_SIZE
+		&& get_unaligned_be16(hdr + 2 * ETH_ALEN) == ETH_P_1588;
+}
+
+/* A copy of the frame is received by another endpoint too, if it's up */
+static void __wrn_rx_mirror(struct wrn_dev *wrn, struct sk_buff *skb,
+			    int epnum)
+{
+	struct net_device *dev = wrn->dev[epnum];
+	struct wrn_ep *ep;
+	struct sk_buff *copy;
+
+	if (!dev || !netif_running(dev))
+		return;
+	copy = skb_clone(skb, GFP_ATOMIC);
+	if (!copy)
+		return;
+	ep = netdev_priv(dev);
+	copy->protocol = eth_type_trans(copy, dev);
+	u64_stats_update_begin(&ep->rx_stats.syncp);
+	ep->rx_stats.packets++;
+	ep->rx_stats.bytes += skb->len;
+	u64_stats_update_end(&ep->rx_stats.syncp);
+	netif_receive_skb(copy);
+}
+
+static void __wrn_rx_descriptor(struct wrn_dev *wrn, int desc,
+				struct wrn_timebase *tb)
 {
 	struct net_device *dev;
 	struct wrn_ep *ep;
 	struct sk_buff *skb;
 	struct wrn_rxd __iomem *rx;
-	u32 r1, r2, r3, offset;
+	u32 r1, r2, r3;
 	int epnum, off, len;
+	int action = WRN_CLS_NOMATCH, arg = 0;
+	u8 hdr[WRN_RX_PEEK_LEN];
 	u32 ts_r, ts_f;
 	struct skb_shared_hwtstamps *hwts;
 	struct timespec ts;
-	u32 counter_ppsg; /* PPS generator nanosecond counter */
-	u32 utc;
-	s32 cntr_diff;
 
 	rx = wrn->rxd + desc;
 	r1 = readl(&rx->rx1);
@@ -310,9 +854,6 @@ static void __wrn_rx_descriptor(struct wrn_dev *wrn, int desc)
 
 	/* So, this descriptor is not empty. Get the port (ep) */
 
-	offset = __wrn_desc_offset(wrn, WRN_DDIR_RX, desc);
-
-
 	if (r1 & NIC_RX1_D1_GOT_TS) {
 		/*
 		 * check if the packet has an RX OOB block
@@ -324,10 +865,13 @@ static void __wrn_rx_descriptor(struct wrn_dev *wrn, int desc)
 		ts_r = NIC_RX1_D2_TS_R_R(r2);
 		ts_f = NIC_RX1_D2_TS_F_R(r2);
 	} else {
-		pr_err("No RX OOB? Something's seriously fkd....\n");
+		if (net_ratelimit())
+			pr_err("No RX OOB? Something's seriously fkd....\n");
 
-		writel( (2000 << 16) | offset, &rx->rx3);
-		writel(NIC_RX1_D1_EMPTY, &rx->rx1); /* FIXME: count as error */
+		__wrn_rx_desc_reload(wrn, desc);
+		u64_stats_update_begin(&wrn->rx_syncp);
+		wrn->rx_no_oob++;
+		u64_stats_update_end(&wrn->rx_syncp);
 		return ;
 	}
 
@@ -337,101 +881,255 @@ static void __wrn_rx_descriptor(struct wrn_dev *wrn, int desc)
 	/* Data and length */
 	off = NIC_RX1_D3_OFFSET_R(r3);
 	len = NIC_RX1_D3_LEN_R(r3);
-	skb = netdev_alloc_skb(dev, len + 16 /* FIXME: real size for rx */);
-	/* FIXME: handle allocation failure */
-	skb_reserve(skb, 2);
+
+	/* Classify and filter, peeking at packet memory: a few reads */
+	if (rcu_access_pointer(wrn->cls)) {
+		__wrn_rx_peek(hdr, wrn->databuf + off, WRN_RX_PEEK_LEN);
+		action = wrn_classify(wrn, epnum, hdr, &arg);
+	} else if (test_bit(0, &wrn->pch_busy)) {
+		__wrn_rx_peek(hdr, wrn->databuf + off, ETH_HLEN);
+	} else {
+		__wrn_rx_peek(hdr, wrn->databuf + off, ETH_ALEN);
+	}
+	if (action != WRN_CLS_DROP && __wrn_rx_is_pch(wrn, hdr, len)) {
+		__wrn_rx_stamp(wrn, tb, ts_r, ts_f, &ts);
+		wrn_pch_rx(wrn, epnum, wrn->databuf + off, len, &ts);
+		__wrn_rx_desc_reload(wrn, desc);
+		u64_stats_update_begin(&ep->rx_stats.syncp);
+		ep->rx_stats.packets++;
+		ep->rx_stats.bytes += len;
+		u64_stats_update_end(&ep->rx_stats.syncp);
+		return;
+	}
+	if (action == WRN_CLS_DROP
+	    || (action != WRN_CLS_PASS && !__wrn_rx_wanted(dev, hdr))) {
+		__wrn_rx_desc_reload(wrn, desc);
+		u64_stats_update_begin(&ep->rx_stats.syncp);
+		ep->rx_stats.filtered++;
+		u64_stats_update_end(&ep->rx_stats.syncp);
+		return;
+	}
+	skb = wrn_rx_skb(wrn, dev, len);
+	if (unlikely(!skb)) {
+		__wrn_rx_desc_reload(wrn, desc);
+		u64_stats_update_begin(&ep->rx_stats.syncp);
+		ep->rx_stats.alloc_fail++;
+		u64_stats_update_end(&ep->rx_stats.syncp);
+		return;
+	}
 	__wrn_copy_in(skb_put(skb, len), wrn->databuf + off, len);
 
 	/*
 	 * reload the descriptor length (it was modified by the NIC
 	 * during reception of the packet)
 	 */
-	writel( (2000 << 16) | offset, &rx->rx3);
-	writel(NIC_RX1_D1_EMPTY, &rx->rx1);
-
-	/* RX timestamping part */
+	__wrn_rx_desc_reload(wrn, desc);
 
-	hwts = skb_hwtstamps(skb);
+	/* RX timestamping part, only if requested */
+	if (test_bit(WRN_EP_STAMPING_RX, &ep->ep_flags)) {
+		hwts = skb_hwtstamps(skb);
 
-	wrn_ppsg_read_time(wrn, &counter_ppsg, &utc);
+		__wrn_rx_stamp(wrn, tb, ts_r, ts_f, &ts);
 
-	if(counter_ppsg < REFCLK_FREQ/4 && ts_r > 3*REFCLK_FREQ/4)
-		utc--;
+		pr_debug("Timestamp: %li:%li, ahead = %d\n",
+		       ts.tv_sec & 0x7fffffff,
+		       ts.tv_nsec & 0x7fffffff,
+		       ts.tv_sec & 0x80000000 ? 1 :0);
 
-	ts.tv_sec = (s32)utc & 0x7fffffff;
-	cntr_diff = (ts_r & 0xf) - ts_f;
-	/* the bit says the rising edge cnter is 1tick ahead */
-	if(cntr_diff == 1 || cntr_diff == (-0xf))
-		ts.tv_sec |= 0x80000000;
-	ts.tv_nsec = ts_r * NSEC_PER_TICK;
-
-	pr_debug("Timestamp: %li:%li, ahead = %d\n",
-	       ts.tv_sec & 0x7fffffff,
-	       ts.tv_nsec & 0x7fffffff,
-	       ts.tv_sec & 0x80000000 ? 1 :0);
-
-	hwts->hwtstamp = timespec_to_ktime(ts);
+		hwts->hwtstamp = timespec_to_ktime(ts);
+	}
+	if (action == WRN_CLS_PRIO)
+		skb->priority = arg;
+	if (action == WRN_CLS_MIRROR)
+		__wrn_rx_mirror(wrn, skb, arg);
 	skb->protocol = eth_type_trans(skb, dev);
 	skb->ip_summed = CHECKSUM_UNNECESSARY;
 	dev->last_rx = jiffies;
-	ep->stats.rx_packets++;
-	ep->stats.rx_bytes += len;
+	u64_stats_update_begin(&ep->rx_stats.syncp);
+	ep->rx_stats.packets++;
+	ep->rx_stats.bytes += len;
+	u64_stats_update_end(&ep->rx_stats.syncp);
 	netif_receive_skb(skb);
 }
 
-static void wrn_rx_interrupt(struct wrn_dev *wrn)
+/* Process up to "budget" received descriptors, return how many were done */
+static int wrn_rx_descriptors(struct wrn_dev *wrn, int budget)
 {
-	int desc;
+	int desc, work_done = 0;
 	struct wrn_rxd __iomem *rx;
+	struct wrn_timebase tb = {0,};
 	u32 reg;
 
-	while (1) {
+	while (work_done < budget) {
 		desc = wrn->next_rx;
 		rx = wrn->rxd + desc;
 		reg = readl(&rx->rx1);
 		if (reg & NIC_RX1_D1_EMPTY)
-			return;
-		__wrn_rx_descriptor(wrn, desc);
-		wrn->next_rx = __wrn_next_desc(desc);
+			break;
+		__wrn_rx_descriptor(wrn, desc, &tb);
+		wrn->next_rx = __wrn_next_rxdesc(wrn, desc);
+		work_done++;
 	}
+	return work_done;
 }
 
-static void wrn_tx_interrupt(struct wrn_dev *wrn)
+/*
+ * NAPI poll function. RCOMP is masked by the interrupt handler and
+ * re-enabled here once the ring is empty. If frames arrive in the
+ * meantime the status bit is set again and we get a new interrupt.
+ */
+int wrn_poll(struct napi_struct *napi, int budget)
 {
+	struct wrn_dev *wrn = container_of(napi, struct wrn_dev, napi);
+	int work_done;
+
+	work_done = wrn_rx_descriptors(wrn, budget);
+	if (work_done < budget) {
+		napi_complete(napi);
+		writel(NIC_EIC_IER_RCOMP, (void *)wrn->regs + WRN_NIC_EIC_IER);
+	}
+	return work_done;
+}
+
+/*
+ * Tx done. This runs in a tasklet, scheduled by the interrupt or by the
+ * moderation timer, as it refills the ring, which means copying frames.
+ */
+static void wrn_tx_complete(unsigned long arg)
+{
+	struct wrn_dev *wrn = (struct wrn_dev *)arg;
 	struct wrn_txd *tx;
 	struct sk_buff *skb;
 	struct skb_shared_info *info;
 
+	/* Completed frames and bytes for each endpoint queue, for BQL */
+	unsigned int pkts[WRN_NR_ENDPOINTS][WRN_NR_TXQ] = {{0,},};
+	unsigned int bytes[WRN_NR_ENDPOINTS][WRN_NR_TXQ] = {{0,},};
+	struct net_device *dev;
+	struct wrn_ep *ep;
+	unsigned long flags;
 	u32 reg;
-	int i;
+	int i, q;
 
-	/* Loop using our talil until one is not sent */
-	while ( (i = wrn->next_tx_tail) != wrn->next_tx_head) {
+	spin_lock_irqsave(&wrn->lock, flags);
+	/* Loop using our tail until one is not sent */
+	while (wrn->tx_inflight) {
 		/* Check if this is txdone */
+		i = wrn->next_tx_tail;
 		tx = wrn->txd + i;
 		reg = readl(&tx->tx1);
 		if (reg & NIC_TX1_D1_READY)
-			return; /* no more */
+			break; /* no more */
+
+		/* The NIC is done with the buffer, release it */
+		wrn->txbuf_tail = wrn->skb_desc[i].buf_end;
+		wrn->tx_inflight--;
 
 		skb = wrn->skb_desc[i].skb;
-		if (!skb) {
-			pr_err("no socket in descriptor %i\n");
-			return;
+		if (!skb) { /* sent by wrn_tx_raw() */
+			wrn->next_tx_tail = __wrn_next_txdesc(wrn, i);
+			continue;
 		}
 		info = skb_shinfo(skb);
+		ep = netdev_priv(skb->dev);
+		if (wrn->skb_desc[i].gen == ep->txq_gen) {
+			q = skb_get_queue_mapping(skb);
+			pkts[ep->ep_number][q]++;
+			bytes[ep->ep_number][q] += skb->len;
+		}
 
 		if (info->tx_flags & SKBTX_HW_TSTAMP) {
 			/* hardware timestamping is enabled */
 			info->tx_flags |= SKBTX_IN_PROGRESS;
 			pr_debug("%s: %i -- in progress\n", __func__, __LINE__);
 			wrn_tstamp_find_skb(wrn, i);
-			/* It has been freed if found; otherwise keep it */
+			/* It has been freed if found; otherwise parked */
 		} else {
 			dev_kfree_skb_irq(skb);
 			wrn->skb_desc[i].skb = 0;
 		}
-		wrn->next_tx_tail = __wrn_next_desc(i);
+		wrn->next_tx_tail = __wrn_next_txdesc(wrn, i);
 	}
+
+	spin_unlock_irqrestore(&wrn->lock, flags);
+
+	/* Refill the ring (this wakes pch_wait), then account and wake */
+	wrn_tx_schedule(wrn);
+	spin_lock_irqsave(&wrn->lock, flags);
+	for (i = 0; i < WRN_NR_ENDPOINTS; i++) {
+		if (!(dev = wrn->dev[i]))
+			continue;
+		ep = netdev_priv(dev);
+		for (q = 0; q < WRN_NR_TXQ; q++) {
+			if (pkts[i][q])
+				netdev_tx_completed_queue(
+					netdev_get_tx_queue(dev, q),
+					pkts[i][q], bytes[i][q]);
+			if (__netif_subqueue_stopped(dev, q)
+			    && netif_running(dev)
+			    && skb_queue_len(&ep->txq[q]) < WRN_TXQ_LEN / 2)
+				netif_wake_subqueue(dev, q);
+		}
+	}
+	spin_unlock_irqrestore(&wrn->lock, flags);
+}
+
+/*
+ * Interrupt moderation (ethtool -C). The NIC raises one interrupt per
+ * event, so after the first one we mask the source and process the ring
+ * when a timer expires or, checked at each NIC interrupt, when enough
+ * descriptors are ready. The settings are per device, as the rings are.
+ */
+static int __wrn_rx_ready(struct wrn_dev *wrn, int n)
+{
+	int desc = (wrn->next_rx + n - 1) % WRN_NR_RXDESC;
+
+	if (n <= 0)
+		return 0;
+	return !(readl(&wrn->rxd[desc].rx1) & NIC_RX1_D1_EMPTY);
+}
+
+static int __wrn_tx_done(struct wrn_dev *wrn, int n)
+{
+	int desc = (wrn->next_tx_tail + n - 1) % WRN_NR_TXDESC;
+
+	if (n <= 0 || n > wrn->tx_inflight)
+		return 0;
+	return !(readl(&wrn->txd[desc].tx1) & NIC_TX1_D1_READY);
+}
+
+static enum hrtimer_restart wrn_rx_timer(struct hrtimer *t)
+{
+	struct wrn_dev *wrn = container_of(t, struct wrn_dev, rx_timer);
+
+	napi_schedule(&wrn->napi); /* wrn_poll() unmasks RCOMP */
+	return HRTIMER_NORESTART;
+}
+
+static enum hrtimer_restart wrn_tx_timer(struct hrtimer *t)
+{
+	struct wrn_dev *wrn = container_of(t, struct wrn_dev, tx_timer);
+
+	tasklet_schedule(&wrn->tx_tasklet);
+	writel(NIC_EIC_IER_TCOMP, (void *)wrn->regs + WRN_NIC_EIC_IER);
+	return HRTIMER_NORESTART;
+}
+
+void wrn_coalesce_init(struct wrn_dev *wrn)
+{
+	hrtimer_init(&wrn->rx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	wrn->rx_timer.function = wrn_rx_timer;
+	hrtimer_init(&wrn->tx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	wrn->tx_timer.function = wrn_tx_timer;
+	tasklet_init(&wrn->tx_tasklet, wrn_tx_complete, (unsigned long)wrn);
+}
+
+/* Called after the irqs are disabled or freed (ring change, remove) */
+void wrn_coalesce_stop(struct wrn_dev *wrn)
+{
+	hrtimer_cancel(&wrn->rx_timer);
+	hrtimer_cancel(&wrn->tx_timer);
+	tasklet_kill(&wrn->tx_tasklet); /* after the timer, that schedules it */
 }
 
 irqreturn_t wrn_interrupt(int irq, void *dev_id)
@@ -440,22 +1138,42 @@ irqreturn_t wrn_interrupt(int irq, void *dev_id)
 	struct NIC_WB *regs = wrn->regs;
 	u32 i, irqs;
 
-	irqs = readl((void *)regs + 0x2c /*EIC_ISR */);
+	irqs = readl((void *)regs + WRN_NIC_EIC_ISR);
 	i =  readl(&regs->SR);
 	pr_debug("%s: irqs 0x%x, sr 0x%x\n", __func__, irqs, i);
 	if (irqs & NIC_EIC_ISR_TXERR) {
 		pr_err("%s: TX error\n", __func__); /* FIXME */
-		writel(NIC_EIC_ISR_TXERR, (void *)regs + 0x2c);
+		writel(NIC_EIC_ISR_TXERR, (void *)regs + WRN_NIC_EIC_ISR);
 	}
 	if (irqs & NIC_EIC_ISR_TCOMP) {
 		pr_debug("%s: TX complete\n", __func__);
-		wrn_tx_interrupt(wrn);
-		writel(NIC_EIC_ISR_TCOMP, (void *)regs + 0x2c);
+		if (!wrn->tx_usecs || __wrn_tx_done(wrn, wrn->tx_frames)) {
+			tasklet_schedule(&wrn->tx_tasklet);
+		} else {
+			/* Mask TX completion until wrn_tx_timer() */
+			writel(NIC_EIC_IDR_TCOMP, (void *)regs + WRN_NIC_EIC_IDR);
+			hrtimer_start(&wrn->tx_timer,
+				      ns_to_ktime(wrn->tx_usecs * 1000),
+				      HRTIMER_MODE_REL);
+		}
+		writel(NIC_EIC_ISR_TCOMP, (void *)regs + WRN_NIC_EIC_ISR);
 	}
 	if (irqs & NIC_EIC_ISR_RCOMP) {
 		pr_debug("%s: RX complete\n", __func__);
-		wrn_rx_interrupt(wrn);
-		writel(NIC_EIC_ISR_RCOMP, (void *)regs + 0x2c);
+		/* Mask RX completion until wrn_poll() empties the ring */
+		writel(NIC_EIC_IDR_RCOMP, (void *)regs + WRN_NIC_EIC_IDR);
+		writel(NIC_EIC_ISR_RCOMP, (void *)regs + WRN_NIC_EIC_ISR);
+		if (!wrn->rx_usecs || __wrn_rx_ready(wrn, wrn->rx_frames))
+			napi_schedule(&wrn->napi);
+		else
+			hrtimer_start(&wrn->rx_timer,
+				      ns_to_ktime(wrn->rx_usecs * 1000),
+				      HRTIMER_MODE_REL);
+	} else if (hrtimer_active(&wrn->rx_timer)
+		   && __wrn_rx_ready(wrn, wrn->rx_frames)) {
+		/* Enough frames while waiting: don't wait any more */
+		hrtimer_try_to_cancel(&wrn->rx_timer);
+		napi_schedule(&wrn->napi);
 	}
 	return IRQ_HANDLED;
 }
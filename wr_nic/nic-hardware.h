@@ -65,11 +65,27 @@ enum fpga_blocks {
 /* In addition to the above enumeration, we scan for those many endpoints */
 #define WRN_NR_ENDPOINTS		18
 
-/* 8 tx and 8 rx descriptors */
+/*
+ * 8 tx and 8 rx descriptors, at 0x80 and 0x100 in the NIC control area.
+ * The pools are fixed in the gateware (generate_descriptors(8) in
+ * nic-regs.wb) and the NIC walks all of them: there is no ring length.
+ */
+#define WRN_NIC_TXD_OFFSET	0x80
+#define WRN_NIC_RXD_OFFSET	0x100
+
 #define WRN_NR_DESC	8
 #define WRN_NR_TXDESC	WRN_NR_DESC
 #define WRN_NR_RXDESC	WRN_NR_DESC
 
+/*
+ * The EIC registers of the NIC are not listed in our struct NIC_WB,
+ * so we access them by offset from the NIC base address
+ */
+#define WRN_NIC_EIC_IDR		0x20
+#define WRN_NIC_EIC_IER		0x24
+#define WRN_NIC_EIC_IMR		0x28
+#define WRN_NIC_EIC_ISR		0x2c
+
 /* Magic number for endpoint */
 #define WRN_EP_MAGIC 0xcafebabe
 
@@ -102,8 +118,23 @@ struct wrn_rxd {
 };
 
 /* Some more constants */
-#define WRN_MTU 1540
+#define WRN_MTU 1540 /* frame size for the default 1500-byte mtu */
+#define WRN_FRAME_LEN(mtu)	((mtu) + WRN_MTU - ETH_DATA_LEN)
+#define WRN_MIN_MTU		68
+#define WRN_MAX_FRAME		EP_RFCR_MRU_R(EP_RFCR_MRU_MASK)
 
 #define WRN_DDATA_OFFSET 2 /* data in descriptors is offset by that much */
 
+/*
+ * Each rx descriptor owns a fixed slot in the packet buffer, large enough
+ * for the biggest frame any endpoint accepts. Tx buffers are allocated
+ * from the rest, which must hold at least one such frame: this bounds
+ * the frame size (see wrn_change_mtu).
+ */
+#define WRN_DESC_SIZE(frame)	ALIGN((frame) + WRN_DDATA_OFFSET, 64)
+#define WRN_DATABUF_SIZE	sizeof(((struct NIC_WB *)0)->MEM)
+#define WRN_TXBUF_MIN(frame)	WRN_DESC_SIZE(frame)
+#define WRN_FRAME_FITS(frame)	(WRN_NR_RXDESC * WRN_DESC_SIZE(frame) \
+				 + WRN_TXBUF_MIN(frame) <= WRN_DATABUF_SIZE)
+
 #endif /* __WR_NIC_HARDWARE_H__ */
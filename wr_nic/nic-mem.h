@@ -9,56 +9,292 @@
  * published by the Free Software Foundation.
  */
 #include "wr-nic.h"
+#include <linux/highmem.h>
 #include <asm/unaligned.h>
 
-/* Descriptor direction, used to locate descriptror data memory */
-enum wrn_ddir {
-    WRN_DDIR_RX,
-    WRN_DDIR_TX
-};
+/*
+ * The packet buffer is split in two. Rx descriptors come first, with
+ * a fixed slot each, as the NIC needs room for a full frame. The rest
+ * is a ring of tx buffers, allocated with the exact (rounded) length.
+ */
+static inline int __wrn_rx_offset(struct wrn_dev *wrn, int nr)
+{
+	return wrn->desc_size * nr;
+}
+
+/*
+ * Find room for a tx buffer, returning its offset. Tx descriptors complete
+ * in order, so they are released from the tail (see wrn_tx_complete).
+ * If the free space at the end is too short, we wrap and waste it.
+ * This is called with the lock taken, and doesn't allocate.
+ */
+static inline int __wrn_tx_buf_find(struct wrn_dev *wrn, int len)
+{
+	int start = __wrn_rx_offset(wrn, WRN_NR_RXDESC);
+	int end = WRN_DATABUF_SIZE;
+	int size = ALIGN(len + WRN_DDATA_OFFSET, 4);
+	int head = wrn->txbuf_head, tail = wrn->txbuf_tail;
+
+	if (!wrn->tx_inflight)
+		head = tail = start;
+	else if (head == tail)
+		return -ENOMEM; /* completely full */
+
+	if (head >= tail) {
+		if (end - head < size) {
+			if (tail - start < size)
+				return -ENOMEM;
+			head = start;
+		}
+	} else if (tail - head < size) {
+		return -ENOMEM;
+	}
+	return head;
+}
+
+/* Allocate what __wrn_tx_buf_find() found. Called with the lock taken */
+static inline int __wrn_tx_buf_alloc(struct wrn_dev *wrn, int len)
+{
+	int offset = __wrn_tx_buf_find(wrn, len);
+
+	if (offset < 0)
+		return offset;
+	if (!wrn->tx_inflight)
+		wrn->txbuf_tail = offset;
+	wrn->txbuf_head = offset + ALIGN(len + WRN_DDATA_OFFSET, 4);
+	return offset;
+}
+
+/* Whether a full-size frame can't be sent now. Called with lock taken */
+static inline int __wrn_tx_full(struct wrn_dev *wrn)
+{
+	return wrn->tx_inflight == WRN_NR_TXDESC
+		|| __wrn_tx_buf_find(wrn, wrn->frame_max) < 0;
+}
+
+/* Give an rx descriptor back to the NIC, with its buffer and full size */
+static inline void __wrn_rx_desc_reload(struct wrn_dev *wrn, int desc)
+{
+	struct wrn_rxd __iomem *rx = wrn->rxd + desc;
+	int offset = __wrn_rx_offset(wrn, desc);
+
+	writel((wrn->desc_size << 16) | offset, &rx->rx3);
+	writel(NIC_RX1_D1_EMPTY, &rx->rx1);
+}
+
+/* Next descriptor in either ring */
+static inline int __wrn_next_txdesc(struct wrn_dev *wrn, int i)
+{
+	return (i + 1) % WRN_NR_TXDESC;
+}
 
-/* We place the descriptor memory in fixed positions (2kB each) */
-static inline int __wrn_desc_offset(struct wrn_dev *wrn,
-				    enum wrn_ddir dir, int nr)
+static inline int __wrn_next_rxdesc(struct wrn_dev *wrn, int i)
 {
-	if (dir == WRN_DDIR_RX) nr += WRN_NR_TXDESC;
-	return 0x800 * nr;
+	return (i + 1) % WRN_NR_RXDESC;
 }
 
-static inline u32 __iomem *__wrn_desc_mem(struct wrn_dev *wrn,
-					   enum wrn_ddir dir, int nr)
+/*
+ * Copying frames is the main per-packet cost, as the NIC makes no DMA.
+ * We use raw accessors, so there is no barrier for each word, and a
+ * single barrier at the end, before the caller touches the descriptor.
+ * Raw accessors keep the byte order of memory, like the previous
+ * get_unaligned_le32()/writel() pairs did.
+ *
+ * The common case is an aligned buffer (skb data is at 2 mod 4, and
+ * so is the frame in packet memory): it is copied in bursts of 4 words,
+ * with ldm/stm on ARM so the external bus sees multi-word accesses.
+ */
+#ifdef CONFIG_ARM
+static inline void __wrn_burst_out(u32 __iomem *to, u32 *from, int nburst)
 {
-	/* note: this is a void pointer, but then we return a u32 ptr */
-	void __iomem *ptr = wrn->databuf;
-	return ptr + __wrn_desc_offset(wrn, dir, nr);
+	while (nburst--)
+		asm volatile("ldmia %0!, {r4-r7}\n\t"
+			     "stmia %1!, {r4-r7}"
+			     : "+r" (from), "+r" (to)
+			     : : "r4", "r5", "r6", "r7", "memory");
+}
+
+static inline void __wrn_burst_in(u32 *to, u32 __iomem *from, int nburst)
+{
+	while (nburst--)
+		asm volatile("ldmia %0!, {r4-r7}\n\t"
+			     "stmia %1!, {r4-r7}"
+			     : "+r" (from), "+r" (to)
+			     : : "r4", "r5", "r6", "r7", "memory");
+}
+#else
+static inline void __wrn_burst_out(u32 __iomem *to, u32 *from, int nburst)
+{
+	while (nburst--) {
+		__raw_writel(from[0], to + 0);
+		__raw_writel(from[1], to + 1);
+		__raw_writel(from[2], to + 2);
+		__raw_writel(from[3], to + 3);
+		to += 4; from += 4;
+	}
 }
 
+static inline void __wrn_burst_in(u32 *to, u32 __iomem *from, int nburst)
+{
+	while (nburst--) {
+		to[0] = __raw_readl(from + 0);
+		to[1] = __raw_readl(from + 1);
+		to[2] = __raw_readl(from + 2);
+		to[3] = __raw_readl(from + 3);
+		to += 4; from += 4;
+	}
+}
+#endif
+
 /* The two copy functions take arguments in the same order as memcpy */
 static inline void __wrn_copy_out(u32 __iomem *to, void *from, int size)
 {
-	u32 i;
+	int nwords;
 
 	from -= WRN_DDATA_OFFSET;
 	size += WRN_DDATA_OFFSET;
-	while (size > 0) {
-		i = get_unaligned_le32(from);
-		writel(i, to);
-		to++; from += sizeof(i);
-		size -= sizeof(i);
+	nwords = DIV_ROUND_UP(size, sizeof(u32));
+
+	if (IS_ALIGNED((unsigned long)from, sizeof(u32))) {
+		u32 *src = from;
+
+		__wrn_burst_out(to, src, nwords / 4);
+		to += nwords & ~3; src += nwords & ~3;
+		for (nwords &= 3; nwords; nwords--)
+			__raw_writel(*src++, to++);
+	} else {
+		for (; nwords; nwords--) {
+			__raw_writel(cpu_to_le32(get_unaligned_le32(from)),
+				     to++);
+			from += sizeof(u32);
+		}
 	}
+	wmb(); /* data must be there before the descriptor is written */
+}
+
+/*
+ * Streaming copy, for fragmented frames. Fragments don't end on word
+ * boundaries, so the bytes that don't fill a word are kept in "acc" and
+ * completed by the next fragment. The frame starts after the same
+ * WRN_DDATA_OFFSET bytes of padding (zeroes, here) as above.
+ */
+struct wrn_copy_stream {
+	u32 __iomem *to;
+	union {
+		u32 w;
+		u8 b[4];
+	} acc;
+	int n; /* bytes in acc */
+};
+
+static inline void __wrn_stream_init(struct wrn_copy_stream *st,
+				     u32 __iomem *to)
+{
+	st->to = to;
+	st->acc.w = 0;
+	st->n = WRN_DDATA_OFFSET;
+}
+
+static inline void __wrn_stream_out(struct wrn_copy_stream *st,
+				    const u8 *from, int size)
+{
+	int nwords;
+
+	/* Complete the pending word, if any */
+	while (st->n && size) {
+		st->acc.b[st->n++] = *from++;
+		size--;
+		if (st->n == sizeof(u32)) {
+			__raw_writel(st->acc.w, st->to++);
+			st->n = 0;
+		}
+	}
+
+	/* Then whole words, as in __wrn_copy_out */
+	nwords = size / sizeof(u32);
+	size -= nwords * sizeof(u32);
+	if (IS_ALIGNED((unsigned long)from, sizeof(u32))) {
+		u32 *src = (u32 *)from;
+
+		__wrn_burst_out(st->to, src, nwords / 4);
+		st->to += nwords & ~3; src += nwords & ~3;
+		for (nwords &= 3; nwords; nwords--)
+			__raw_writel(*src++, st->to++);
+		from = (u8 *)src;
+	} else {
+		for (; nwords; nwords--) {
+			__raw_writel(cpu_to_le32(get_unaligned_le32(from)),
+				     st->to++);
+			from += sizeof(u32);
+		}
+	}
+
+	/* And keep the tail for next time */
+	if (size)
+		st->acc.w = 0;
+	while (size--)
+		st->acc.b[st->n++] = *from++;
+}
+
+static inline void __wrn_stream_end(struct wrn_copy_stream *st)
+{
+	if (st->n)
+		__raw_writel(st->acc.w, st->to);
+	wmb(); /* data must be there before the descriptor is written */
+}
+
+/* Fragmented frames are streamed to packet memory, with no linearization */
+static inline void __wrn_copy_out_skb(u32 __iomem *to, struct sk_buff *skb)
+{
+	struct wrn_copy_stream st;
+	skb_frag_t *frag;
+	u8 *vaddr;
+	int i;
+
+	__wrn_stream_init(&st, to);
+	__wrn_stream_out(&st, skb->data, skb_headlen(skb));
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+		frag = &skb_shinfo(skb)->frags[i];
+		vaddr = wrn_kmap_atomic(skb_frag_page(frag));
+		__wrn_stream_out(&st, vaddr + frag->page_offset,
+				 skb_frag_size(frag));
+		wrn_kunmap_atomic(vaddr);
+	}
+	__wrn_stream_end(&st);
 }
 
 static inline void __wrn_copy_in(void *to, u32 __iomem *from, int size)
 {
-	u32 i;
+	int nwords;
 
 	to -= WRN_DDATA_OFFSET;
 	size += WRN_DDATA_OFFSET;
-	while (size > 0) {
-		i = readl(from);
-		put_unaligned_le32(i, to);
-		to += sizeof(i); from++;
-		size -= sizeof(i);
+	nwords = DIV_ROUND_UP(size, sizeof(u32));
+
+	if (IS_ALIGNED((unsigned long)to, sizeof(u32))) {
+		u32 *dst = to;
+
+		__wrn_burst_in(dst, from, nwords / 4);
+		dst += nwords & ~3; from += nwords & ~3;
+		for (nwords &= 3; nwords; nwords--)
+			*dst++ = __raw_readl(from++);
+	} else {
+		for (; nwords; nwords--) {
+			put_unaligned_le32(le32_to_cpu(__raw_readl(from++)),
+					   to);
+			to += sizeof(u32);
+		}
 	}
+	rmb(); /* all data read before the descriptor is given back */
 }
 
+/* Peek the header of a received frame, without copying it all */
+static inline void __wrn_rx_peek(u8 *hdr, u32 __iomem *from, int len)
+{
+	u32 w[DIV_ROUND_UP(WRN_RX_PEEK_LEN + WRN_DDATA_OFFSET, 4)];
+	int i;
+
+	for (i = 0; i < DIV_ROUND_UP(len + WRN_DDATA_OFFSET, 4); i++)
+		w[i] = __raw_readl(from + i);
+	memcpy(hdr, (u8 *)w + WRN_DDATA_OFFSET, len);
+}
@@ -12,6 +12,8 @@
 #include <linux/netdevice.h>
 #include <linux/sockios.h>
 #include <linux/net_tstamp.h>
+#include <linux/workqueue.h>
+#include <linux/math64.h>
 
 #include "wr-nic.h"
 
@@ -29,3 +31,200 @@ void wrn_ppsg_read_time(struct wrn_dev *wrn, u32 *fine_counter, u32 *utc)
 	*utc = utc2;
 	*fine_counter = cnt;
 }
+
+#ifdef WRN_HAS_PHC /* see wr-nic.h */
+/*
+ * PTP hardware clock on top of the PPS generator. The counter can only be
+ * set or offset (by the values in the ADJ registers), so frequency
+ * adjustment is emulated: a work item applies the offset accumulated at
+ * the requested rate every WRN_PTP_ADJ_PERIOD, rounded to whole ticks.
+ */
+#define WRN_PTP_ADJ_PERIOD	(HZ / 10)
+#define WRN_PTP_MAX_ADJ		500000 /* ppb: more than any crystal needs */
+#define WRN_PTP_ADJ_LOOPS	1000 /* CNT_ADJ takes a few refclk cycles */
+
+static struct wrn_dev *ptp_to_wrn(struct ptp_clock_info *ptp)
+{
+	return container_of(ptp, struct wrn_dev, ptp_info);
+}
+
+/* Load the ADJ registers with a time, normalized to 0 <= nsec < 1s */
+static void __wrn_ptp_load_adj(struct wrn_dev *wrn, s64 sec, s32 nsec)
+{
+	if (nsec < 0) {
+		nsec += NSEC_PER_SEC;
+		sec--;
+	}
+	writel(nsec / NSEC_PER_TICK, &wrn->ppsg_regs->ADJ_NSEC);
+	writel((u32)sec, &wrn->ppsg_regs->ADJ_UTCLO);
+	writel((u32)(sec >> 32) & 0xff, &wrn->ppsg_regs->ADJ_UTCHI);
+}
+
+/* Offset the counter by delta nanoseconds. Called with ptp_lock taken */
+static int __wrn_ptp_adjust(struct wrn_dev *wrn, s64 delta)
+{
+	u32 cr;
+	s32 rem;
+	s64 sec;
+	int i;
+
+	sec = div_s64_rem(delta, NSEC_PER_SEC, &rem);
+	__wrn_ptp_load_adj(wrn, sec, rem);
+	cr = readl(&wrn->ppsg_regs->CR) & ~PPSG_CR_CNT_SET;
+	writel(cr | PPSG_CR_CNT_ADJ, &wrn->ppsg_regs->CR);
+	for (i = 0; i < WRN_PTP_ADJ_LOOPS; i++)
+		if (!(readl(&wrn->ppsg_regs->CR) & PPSG_CR_CNT_ADJ))
+			return 0;
+	return -ETIMEDOUT;
+}
+
+static int wrn_ptp_adjtime(struct ptp_clock_info *ptp, s64 delta)
+{
+	struct wrn_dev *wrn = ptp_to_wrn(ptp);
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&wrn->ptp_lock, flags);
+	ret = __wrn_ptp_adjust(wrn, delta);
+	spin_unlock_irqrestore(&wrn->ptp_lock, flags);
+	return ret;
+}
+
+/*
+ * This is the same as wrn_ppsg_read_time: three reads in the common case,
+ * so the system-time samples of PTP_SYS_OFFSET bracket it tightly.
+ * The high part of UTC is not read, as it's beyond a 32-bit time_t
+ */
+static int wrn_ptp_gettime(struct ptp_clock_info *ptp, struct timespec *ts)
+{
+	struct wrn_dev *wrn = ptp_to_wrn(ptp);
+	u32 cnt, utc;
+
+	wrn_ppsg_read_time(wrn, &cnt, &utc);
+	ts->tv_sec = utc;
+	ts->tv_nsec = cnt * NSEC_PER_TICK;
+	return 0;
+}
+
+static int wrn_ptp_settime(struct ptp_clock_info *ptp,
+			   const struct timespec *ts)
+{
+	struct wrn_dev *wrn = ptp_to_wrn(ptp);
+	unsigned long flags;
+	u32 cr;
+
+	spin_lock_irqsave(&wrn->ptp_lock, flags);
+	__wrn_ptp_load_adj(wrn, ts->tv_sec, ts->tv_nsec);
+	cr = readl(&wrn->ppsg_regs->CR) & ~PPSG_CR_CNT_ADJ;
+	writel(cr | PPSG_CR_CNT_SET, &wrn->ppsg_regs->CR);
+	spin_unlock_irqrestore(&wrn->ptp_lock, flags);
+	return 0;
+}
+
+static int wrn_ptp_adjfreq(struct ptp_clock_info *ptp, s32 ppb)
+{
+	struct wrn_dev *wrn = ptp_to_wrn(ptp);
+	unsigned long flags;
+
+	spin_lock_irqsave(&wrn->ptp_lock, flags);
+	if (!wrn->ptp_ppb && ppb) {
+		wrn->ptp_last = ktime_get();
+		schedule_delayed_work(&wrn->ptp_work, WRN_PTP_ADJ_PERIOD);
+	}
+	wrn->ptp_ppb = ppb;
+	spin_unlock_irqrestore(&wrn->ptp_lock, flags);
+	return 0;
+}
+
+static void wrn_ptp_work(struct work_struct *work)
+{
+	struct wrn_dev *wrn = container_of(to_delayed_work(work),
+					   struct wrn_dev, ptp_work);
+	unsigned long flags;
+	ktime_t now;
+	s64 ticks;
+	s32 rem;
+
+	spin_lock_irqsave(&wrn->ptp_lock, flags);
+	if (!wrn->ptp_ppb) {
+		spin_unlock_irqrestore(&wrn->ptp_lock, flags);
+		return;
+	}
+	/* ppb * ns is in units of 1e-9 ns: carry remainders across runs */
+	now = ktime_get();
+	wrn->ptp_frac += (s64)wrn->ptp_ppb
+		* ktime_to_ns(ktime_sub(now, wrn->ptp_last));
+	wrn->ptp_last = now;
+	wrn->ptp_ns += div_s64_rem(wrn->ptp_frac, NSEC_PER_SEC, &rem);
+	wrn->ptp_frac = rem;
+	ticks = div_s64_rem(wrn->ptp_ns, NSEC_PER_TICK, &rem);
+	wrn->ptp_ns = rem;
+	if (ticks)
+		__wrn_ptp_adjust(wrn, ticks * NSEC_PER_TICK);
+	schedule_delayed_work(&wrn->ptp_work, WRN_PTP_ADJ_PERIOD);
+	spin_unlock_irqrestore(&wrn->ptp_lock, flags);
+}
+
+static int wrn_ptp_enable(struct ptp_clock_info *ptp,
+			  struct ptp_clock_request *rq, int on)
+{
+	return -EOPNOTSUPP;
+}
+
+static struct ptp_clock_info wrn_ptp_info = {
+	.owner		= THIS_MODULE,
+	.name		= DRV_NAME,
+	.max_adj	= WRN_PTP_MAX_ADJ,
+	.adjfreq	= wrn_ptp_adjfreq,
+	.adjtime	= wrn_ptp_adjtime,
+	.gettime	= wrn_ptp_gettime,
+	.settime	= wrn_ptp_settime,
+	.enable		= wrn_ptp_enable,
+};
+
+/* A missing PTP clock is not fatal: the NIC works without it */
+void wrn_ptp_init(struct wrn_dev *wrn, struct device *parent)
+{
+	spin_lock_init(&wrn->ptp_lock);
+	INIT_DELAYED_WORK(&wrn->ptp_work, wrn_ptp_work);
+	wrn->ptp_info = wrn_ptp_info;
+	wrn->ptp_clock = ptp_clock_register(&wrn->ptp_info, parent);
+	if (IS_ERR(wrn->ptp_clock)) {
+		dev_warn(parent, "can't register PTP clock (%li)\n",
+			 PTR_ERR(wrn->ptp_clock));
+		wrn->ptp_clock = NULL;
+	}
+}
+
+void wrn_ptp_exit(struct wrn_dev *wrn)
+{
+	if (!wrn->ptp_clock)
+		return;
+	ptp_clock_unregister(wrn->ptp_clock);
+	wrn->ptp_clock = NULL;
+	wrn->ptp_ppb = 0;
+	cancel_delayed_work_sync(&wrn->ptp_work);
+}
+
+/* For ethtool get_ts_info */
+int wrn_ptp_index(struct wrn_dev *wrn)
+{
+	return wrn->ptp_clock ? ptp_clock_index(wrn->ptp_clock) : -1;
+}
+
+#else /* !WRN_HAS_PHC */
+
+void wrn_ptp_init(struct wrn_dev *wrn, struct device *parent)
+{
+	dev_info(parent, "no PTP clock support in this kernel\n");
+}
+
+void wrn_ptp_exit(struct wrn_dev *wrn)
+{
+}
+
+int wrn_ptp_index(struct wrn_dev *wrn)
+{
+	return -1;
+}
+#endif /* WRN_HAS_PHC */
@@ -0,0 +1,175 @@
+/*
+ * PTP frame channel: PTP frames to and from user space with no skb
+ *
+ * Copyright (C) 2010 CERN (www.cern.ch)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <linux/kernel.h>
+#include <linux/netdevice.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+
+#include "wr-nic.h"
+#include "nic-mem.h"
+
+/*
+ * While /dev/wr-ptp is open, napi copies PTP frames from packet memory
+ * straight to the ring, with the stamp already resolved (see wr-nic.h).
+ * The ring is allocated at first open and kept until the module is
+ * removed, as it may still be mapped. Only one process can open it.
+ */
+void wrn_pch_rx(struct wrn_dev *wrn, int port, u32 __iomem *frame,
+		int len, struct timespec *ts)
+{
+	struct wrn_pch_ring *ring = wrn->pch_ring;
+	struct wrn_pch_rec *rec;
+	u32 head;
+
+	head = ring->head;
+	rec = ring->rec + (head & (WRN_PCH_RING_SIZE - 1));
+	__wrn_copy_in(rec->data, frame, len);
+	rec->sec = ts->tv_sec & 0x7fffffff;
+	rec->nsec = ts->tv_nsec;
+	rec->port = port;
+	rec->len = len;
+	rec->flags = ts->tv_sec & 0x80000000 ? WRN_PCH_F_AHEAD : 0;
+	smp_wmb(); /* record before head */
+	ring->head = head + 1;
+	wake_up_interruptible(&wrn->pch_wait);
+}
+
+static struct wrn_dev *pch_misc_to_wrn(struct file *f)
+{
+	return container_of(f->private_data, struct wrn_dev, pch_misc);
+}
+
+static int wrn_pch_open(struct inode *inode, struct file *f)
+{
+	struct wrn_dev *wrn = pch_misc_to_wrn(f);
+	struct wrn_pch_ring *ring;
+
+	if (test_and_set_bit(0, &wrn->pch_busy))
+		return -EBUSY;
+	if (wrn->pch_ring)
+		return 0;
+
+	ring = vmalloc_user(PAGE_ALIGN(sizeof(*ring)));
+	if (!ring) {
+		clear_bit(0, &wrn->pch_busy);
+		return -ENOMEM;
+	}
+	ring->size = WRN_PCH_RING_SIZE;
+	smp_wmb(); /* napi checks the pointer */
+	wrn->pch_ring = ring;
+	return 0;
+}
+
+/* Frames go back to the network stack */
+static int wrn_pch_release(struct inode *inode, struct file *f)
+{
+	struct wrn_dev *wrn = pch_misc_to_wrn(f);
+
+	clear_bit(0, &wrn->pch_busy);
+	return 0;
+}
+
+static int wrn_pch_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	struct wrn_dev *wrn = pch_misc_to_wrn(f);
+
+	if (vma->vm_pgoff
+	    || vma->vm_end - vma->vm_start > PAGE_ALIGN(sizeof(*wrn->pch_ring)))
+		return -EINVAL;
+	return remap_vmalloc_range(vma, wrn->pch_ring, 0);
+}
+
+/*
+ * A frame is sent straight from a stack buffer to packet memory. If the
+ * tx ring is full we sleep until the tx-done interrupt wakes us up.
+ */
+static ssize_t wrn_pch_write(struct file *f, const char __user *buf,
+			     size_t count, loff_t *offp)
+{
+	struct wrn_dev *wrn = pch_misc_to_wrn(f);
+	struct wrn_pch_txhdr hdr;
+	u32 frame[DIV_ROUND_UP(WRN_DDATA_OFFSET + WRN_PCH_FRAME_SIZE, 4)];
+	void *data = (void *)frame + WRN_DDATA_OFFSET; /* like skb->data */
+	int len = count - sizeof(hdr);
+	int id, stamp;
+
+	if (count < sizeof(hdr) + ETH_HLEN || len > WRN_PCH_FRAME_SIZE)
+		return -EINVAL;
+	if (copy_from_user(&hdr, buf, sizeof(hdr))
+	    || copy_from_user(data, buf + sizeof(hdr), len))
+		return -EFAULT;
+	if (hdr.flags & ~WRN_PCH_F_STAMP)
+		return -EINVAL;
+	if (hdr.port >= WRN_NR_ENDPOINTS || !wrn->dev[hdr.port]
+	    || !netif_running(wrn->dev[hdr.port]))
+		return -ENODEV;
+	stamp = hdr.flags & WRN_PCH_F_STAMP;
+
+	if (f->f_flags & O_NONBLOCK)
+		id = wrn_tx_raw(wrn, hdr.port, data, len, stamp);
+	else if (wait_event_interruptible(wrn->pch_wait,
+		 (id = wrn_tx_raw(wrn, hdr.port, data, len, stamp)) != -EAGAIN))
+		return -ERESTARTSYS;
+	if (id < 0)
+		return id;
+	wrn->pch_ring->tx_id = id;
+	return count;
+}
+
+static unsigned int wrn_pch_poll(struct file *f, poll_table *wait)
+{
+	struct wrn_dev *wrn = pch_misc_to_wrn(f);
+	struct wrn_pch_ring *ring = wrn->pch_ring;
+	unsigned int mask = 0;
+	unsigned long flags;
+
+	poll_wait(f, &wrn->pch_wait, wait);
+	if (ACCESS_ONCE(ring->head) != ACCESS_ONCE(ring->tail))
+		mask |= POLLIN | POLLRDNORM;
+	spin_lock_irqsave(&wrn->lock, flags);
+	if (!__wrn_tx_full(wrn))
+		mask |= POLLOUT | POLLWRNORM;
+	spin_unlock_irqrestore(&wrn->lock, flags);
+	return mask;
+}
+
+static const struct file_operations wrn_pch_fops = {
+	.owner		= THIS_MODULE,
+	.open		= wrn_pch_open,
+	.release	= wrn_pch_release,
+	.mmap		= wrn_pch_mmap,
+	.write		= wrn_pch_write,
+	.poll		= wrn_pch_poll,
+};
+
+/* The channel is optional: only warn if it's not there */
+void wrn_pch_init(struct wrn_dev *wrn)
+{
+	init_waitqueue_head(&wrn->pch_wait);
+	wrn->pch_misc.minor = MISC_DYNAMIC_MINOR;
+	wrn->pch_misc.name = "wr-ptp";
+	wrn->pch_misc.fops = &wrn_pch_fops;
+	if (misc_register(&wrn->pch_misc) < 0)
+		printk(KERN_WARNING "%s: can't register wr-ptp\n", __func__);
+	else
+		wrn->pch_misc_registered = 1;
+}
+
+void wrn_pch_exit(struct wrn_dev *wrn)
+{
+	if (wrn->pch_misc_registered) {
+		misc_deregister(&wrn->pch_misc);
+		wrn->pch_misc_registered = 0;
+	}
+	vfree(wrn->pch_ring);
+	wrn->pch_ring = NULL;
+}
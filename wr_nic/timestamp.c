@@ -12,98 +12,130 @@
 #include <linux/netdevice.h>
 #include <linux/sockios.h>
 #include <linux/net_tstamp.h>
+#include <linux/miscdevice.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
 
 #include "wr-nic.h"
 
-/* This looks for an skb in the already-received stamp list */
-void wrn_tstamp_find_skb(struct wrn_dev *wrn, int desc)
+/*
+ * Stamps and frames meet in two direct-mapped tables indexed by the low
+ * bits of the 16-bit frame id: ts_buf[] for stamps that arrived before
+ * tx-done, ts_skb[] for frames whose stamp is not there yet. Ids are
+ * allocated in sequence, so an entry with a different id in the slot is
+ * WRN_TS_BUF_SIZE frames old and can be dropped. All of this is O(1),
+ * whatever the backlog. Everything here is called with wrn->lock taken.
+ */
+
+/* The stamp is in the past, possibly in the previous second */
+static u32 __wrn_tstamp_utc(struct wrn_dev *wrn, u32 tsval)
 {
-	struct skb_shared_hwtstamps *hwts;
-	struct sk_buff *skb = wrn->skb_desc[desc].skb;
-	struct timespec ts;
-	int id = wrn->skb_desc[desc].id;
 	u32 counter_ppsg; /* PPS generator nanosecond counter */
 	u32 utc;
-	int i; /* FIXME: use list for faster access */
 
-	for(i = 0; i < WRN_TS_BUF_SIZE; i++)
-		if(wrn->ts_buf[i].valid && wrn->ts_buf[i].frame_id == id)
-			break;
-
-	if (i == WRN_TS_BUF_SIZE) {
-		pr_debug("%s: not found\n", __func__);
-		return;
-	}
-	pr_debug("%s: found\n", __func__);
-
-	/* so we found the skb, do the timestamping magic */
-	hwts = skb_hwtstamps(skb);
 	wrn_ppsg_read_time(wrn, &counter_ppsg, &utc);
-	if(counter_ppsg > 3*REFCLK_FREQ/4 && wrn->ts_buf[i].ts < REFCLK_FREQ/4)
+	if(counter_ppsg < REFCLK_FREQ/4 && tsval > 3*REFCLK_FREQ/4)
 		utc--;
+	return utc;
+}
 
-	ts.tv_sec = (s32)utc & 0x7fffffff;
-	ts.tv_nsec = wrn->ts_buf[i].ts * NSEC_PER_TICK;
+static void __wrn_tstamp_deliver(struct wrn_dev *wrn, struct sk_buff *skb,
+				 u32 tsval)
+{
+	struct skb_shared_hwtstamps *hwts;
+	struct timespec ts;
+
+	hwts = skb_hwtstamps(skb);
+	ts.tv_sec = (s32)__wrn_tstamp_utc(wrn, tsval) & 0x7fffffff;
+	ts.tv_nsec = tsval * NSEC_PER_TICK;
 	hwts->hwtstamp = timespec_to_ktime(ts);
 	skb_tstamp_tx(skb, hwts);
 	dev_kfree_skb_irq(skb);
+}
+
+/* At tx-done time: stamp the frame now or park it until the stamp comes */
+void wrn_tstamp_find_skb(struct wrn_dev *wrn, int desc)
+{
+	struct sk_buff *skb = wrn->skb_desc[desc].skb;
+	int id = wrn->skb_desc[desc].id;
+	struct wrn_tx_tstamp *t = wrn->ts_buf + WRN_TS_SLOT(id);
+	struct wrn_desc_pending *p = wrn->ts_skb + WRN_TS_SLOT(id);
 
-	/* release both the descriptor and the tstamp entry */
+	/* The descriptor is free to be reused in any case */
 	wrn->skb_desc[desc].skb = 0;
-	wrn->ts_buf[i].valid = 0;
+
+	if (t->valid && t->frame_id == id) {
+		pr_debug("%s: found\n", __func__);
+		__wrn_tstamp_deliver(wrn, skb, t->ts);
+		t->valid = 0;
+		return;
+	}
+	pr_debug("%s: not found\n", __func__);
+
+	if (p->skb) {
+		/* Its stamp never came: give up on it */
+		pr_debug("%s: evict frame %i\n", __func__, p->id);
+		dev_kfree_skb_irq(p->skb);
+	}
+	p->skb = skb;
+	p->id = id;
 }
 
-/* This function records the timestamp in a list -- called from interrupt */
-static int record_tstamp(struct wrn_dev *wrn, u32 tsval, u32 idreg)
+/*
+ * Every tx stamp is also published in a ring that user space can mmap
+ * from /dev/wr-tstamp, so a daemon can collect stamps for all ports with
+ * no syscall at all (the layout is in wr-nic.h). The ring is allocated
+ * at first open and kept until the module is removed.
+ */
+static void __wrn_tstamp_publish(struct wrn_dev *wrn, u32 tsval,
+				 int port_id, int frame_id)
+{
+	struct wrn_tstamp_ring *ring = wrn->ts_ring;
+	struct wrn_tstamp_rec *rec;
+	u32 head;
+
+	if (!ring)
+		return;
+	head = ring->head;
+	rec = ring->rec + (head & (WRN_TSTAMP_RING_SIZE - 1));
+	rec->port_id = port_id;
+	rec->frame_id = frame_id;
+	rec->sec = __wrn_tstamp_utc(wrn, tsval);
+	rec->nsec = tsval * NSEC_PER_TICK;
+	smp_wmb(); /* record before head */
+	ring->head = head + 1;
+	wake_up_interruptible(&wrn->ts_wait);
+}
+
+/* This function records the timestamp or stamps the frame -- from irq */
+static void record_tstamp(struct wrn_dev *wrn, u32 tsval, u32 idreg)
 {
 	int port_id = TXTSU_TSF_R1_PID_R(idreg);
 	int frame_id = TXTSU_TSF_R1_FID_R(idreg);
-	struct skb_shared_hwtstamps *hwts;
-	struct timespec ts;
-	struct sk_buff *skb;
-	u32 utc, counter_ppsg; /* PPS generator nanosecond counter */
-	int i; /* FIXME: use list for faster access */
+	struct wrn_tx_tstamp *t = wrn->ts_buf + WRN_TS_SLOT(frame_id);
+	struct wrn_desc_pending *p = wrn->ts_skb + WRN_TS_SLOT(frame_id);
 
 	/*printk("%s: Got TS: %x pid %d fid %d\n", __func__,
 		 tsval, port_id, frame_id);*/
+	tsval &= 0xfffffff;
+	__wrn_tstamp_publish(wrn, tsval, port_id, frame_id);
 
 	/* First of all look if the skb is already pending */
-	for (i = 0; i < WRN_NR_DESC; i++)
-		if (wrn->skb_desc[i].skb && wrn->skb_desc[i].id == frame_id)
-			break;
-
-	if (i < WRN_NR_DESC) {
-		/*printk("%s: found\n", __func__);*/
-		skb = wrn->skb_desc[i].skb;
-		hwts = skb_hwtstamps(skb);
-
-		wrn_ppsg_read_time(wrn, &counter_ppsg, &utc);
-		if(counter_ppsg < (tsval & 0xfffffff))
-			utc--;
-
-		ts.tv_sec = (s32)utc & 0x7fffffff;
-		ts.tv_nsec = (tsval & 0xfffffff) * NSEC_PER_TICK;
-		hwts->hwtstamp = timespec_to_ktime(ts);
-		skb_tstamp_tx(skb, hwts);
-		dev_kfree_skb_irq(skb);
-		wrn->skb_desc[i].skb = 0;
-		return 0;
+	if (p->skb && p->id == frame_id) {
+		__wrn_tstamp_deliver(wrn, p->skb, tsval);
+		p->skb = NULL;
+		return;
 	}
-	/* Otherwise, save it to the list  */
-	for(i = 0; i < WRN_TS_BUF_SIZE; i++)
-		if(!wrn->ts_buf[i].valid)
-			break;
 
-	if (i == WRN_TS_BUF_SIZE) {
-		pr_debug("%s: ENOMEM\n", __func__);
-		return -ENOMEM;
-	}
-	pr_debug("%s: save to slot %i\n", __func__, i);
-	wrn->ts_buf[i].ts = tsval;
-	wrn->ts_buf[i].port_id = port_id;
-	wrn->ts_buf[i].frame_id = frame_id;
-	wrn->ts_buf[i].valid = 1;
-	return 0;
+	/* Otherwise, save it (overwriting a stale one, if any) */
+	if (t->valid)
+		pr_debug("%s: evict stamp %i\n", __func__, t->frame_id);
+	t->ts = tsval;
+	t->port_id = port_id;
+	t->frame_id = frame_id;
+	t->valid = 1;
 }
 
 irqreturn_t wrn_tstamp_interrupt(int irq, void *dev_id)
@@ -113,15 +145,12 @@ irqreturn_t wrn_tstamp_interrupt(int irq, void *dev_id)
 	u32 r0, r1;
 
 	/* printk("%s: %i\n", __func__, __LINE__); */
-	/* FIXME: locking */
 	r0 = readl(&regs->TSF_R0);
 	r1 = readl(&regs->TSF_R1);
 
-	if(record_tstamp(wrn, r0, r1) < 0) {
-		printk("%s: ENOMEM in the TS buffer. Disabling TX stamping.\n",
-		       __func__);
-		writel(TXTSU_EIC_IER_NEMPTY, &wrn->txtsu_regs->EIC_IDR);
-	}
+	spin_lock(&wrn->lock);
+	record_tstamp(wrn, r0, r1);
+	spin_unlock(&wrn->lock);
 	writel(TXTSU_EIC_IER_NEMPTY, &wrn->txtsu_regs->EIC_ISR); /* ack irq */
 	return IRQ_HANDLED;
 }
@@ -176,10 +205,101 @@ int wrn_tstamp_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
 	return 0;
 }
 
+/* The misc device for the stamp ring */
+static struct wrn_dev *ts_misc_to_wrn(struct file *f)
+{
+	return container_of(f->private_data, struct wrn_dev, ts_misc);
+}
+
+static int wrn_tstamp_open(struct inode *inode, struct file *f)
+{
+	struct wrn_dev *wrn = ts_misc_to_wrn(f);
+	struct wrn_tstamp_ring *ring;
+	unsigned long flags;
+
+	if (wrn->ts_ring)
+		return 0;
+	ring = vmalloc_user(PAGE_ALIGN(sizeof(*ring)));
+	if (!ring)
+		return -ENOMEM;
+	ring->size = WRN_TSTAMP_RING_SIZE;
+
+	spin_lock_irqsave(&wrn->lock, flags);
+	if (!wrn->ts_ring) {
+		wrn->ts_ring = ring;
+		ring = NULL;
+	}
+	spin_unlock_irqrestore(&wrn->lock, flags);
+	vfree(ring); /* lost a race with another open */
+	return 0;
+}
+
+static int wrn_tstamp_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	struct wrn_dev *wrn = ts_misc_to_wrn(f);
+
+	if (vma->vm_pgoff
+	    || vma->vm_end - vma->vm_start > PAGE_ALIGN(sizeof(*wrn->ts_ring)))
+		return -EINVAL;
+	return remap_vmalloc_range(vma, wrn->ts_ring, 0);
+}
+
+/* Readable when the reader's tail (in the ring itself) is behind head */
+static unsigned int wrn_tstamp_poll(struct file *f, poll_table *wait)
+{
+	struct wrn_dev *wrn = ts_misc_to_wrn(f);
+	struct wrn_tstamp_ring *ring = wrn->ts_ring;
+
+	poll_wait(f, &wrn->ts_wait, wait);
+	if (ACCESS_ONCE(ring->head) != ACCESS_ONCE(ring->tail))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static const struct file_operations wrn_tstamp_fops = {
+	.owner		= THIS_MODULE,
+	.open		= wrn_tstamp_open,
+	.mmap		= wrn_tstamp_mmap,
+	.poll		= wrn_tstamp_poll,
+};
+
 void wrn_tstamp_init(struct wrn_dev *wrn)
 {
 	memset(wrn->ts_buf, 0, sizeof(wrn->ts_buf));
+	memset(wrn->ts_skb, 0, sizeof(wrn->ts_skb));
 	/* enable TXTSU irq */
 	writel(TXTSU_EIC_IER_NEMPTY, &wrn->txtsu_regs->EIC_IER);
+
+	/* The stamp ring is optional: only warn if it's not there */
+	init_waitqueue_head(&wrn->ts_wait);
+	wrn->ts_misc.minor = MISC_DYNAMIC_MINOR;
+	wrn->ts_misc.name = "wr-tstamp";
+	wrn->ts_misc.fops = &wrn_tstamp_fops;
+	if (misc_register(&wrn->ts_misc) < 0)
+		printk(KERN_WARNING "%s: can't register wr-tstamp\n",
+		       __func__);
+	else
+		wrn->ts_misc_registered = 1;
 }
 
+/* Free the frames still waiting for a stamp, and the stamp ring */
+void wrn_tstamp_release(struct wrn_dev *wrn)
+{
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&wrn->lock, flags);
+	for (i = 0; i < WRN_TS_BUF_SIZE; i++) {
+		if (wrn->ts_skb[i].skb)
+			dev_kfree_skb_any(wrn->ts_skb[i].skb);
+		wrn->ts_skb[i].skb = NULL;
+	}
+	spin_unlock_irqrestore(&wrn->lock, flags);
+
+	if (wrn->ts_misc_registered) {
+		misc_deregister(&wrn->ts_misc);
+		wrn->ts_misc_registered = 0;
+	}
+	vfree(wrn->ts_ring);
+	wrn->ts_ring = NULL;
+}
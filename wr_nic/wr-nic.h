@@ -12,14 +12,87 @@
  */
 #ifndef __WR_NIC_H__
 #define __WR_NIC_H__
+#include <linux/version.h>
+
+/*
+ * The PTP hardware clock needs the PTP core and the two-argument
+ * ptp_clock_register() of 3.7. Without them the NIC works with no PHC.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0) \
+	&& (defined(CONFIG_PTP_1588_CLOCK) \
+	    || defined(CONFIG_PTP_1588_CLOCK_MODULE))
+#define WRN_HAS_PHC
+#endif
+
 #include <linux/irqreturn.h>
 #include <linux/spinlock.h>
 #include <linux/mii.h>		/* Needed for stuct mii_if_info in wrn_dev */
 #include <linux/netdevice.h>	/* Needed for net_device_stats in wrn_dev */
-#include <linux/timer.h>	/* Needed for struct time_list in wrn_dev*/
+#include <linux/mutex.h>	/* Needed for mdio_mutex in wrn_dev */
+#include <linux/workqueue.h>	/* Needed for ptp_work in wrn_dev */
+#ifdef WRN_HAS_PHC
+#include <linux/ptp_clock_kernel.h> /* Needed for ptp_info in wrn_dev */
+#endif
+#include <linux/miscdevice.h>	/* Needed for ts_misc in wrn_dev */
+#include <linux/wait.h>		/* Needed for ts_wait in wrn_dev */
+#include <linux/hrtimer.h>	/* Needed for rx_timer in wrn_dev */
+#include <linux/interrupt.h>	/* Needed for tx_tasklet in wrn_dev */
+#include <linux/if_vlan.h>	/* Needed for WRN_RX_PEEK_LEN */
+#include <linux/u64_stats_sync.h> /* Needed for wrn_ep_stats */
 
 #include "nic-hardware.h" /* Magic numbers: please fix them as needed */
 
+/*
+ * The driver runs on 2.6.35; byte queue limits only exist since 3.3,
+ * so with older kernels tx flow control relies on queue stop/wake alone.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,3,0)
+static inline void netdev_tx_sent_queue(struct netdev_queue *q,
+					unsigned int bytes) {}
+static inline void netdev_tx_completed_queue(struct netdev_queue *q,
+					     unsigned int pkts,
+					     unsigned int bytes) {}
+static inline void netdev_tx_reset_queue(struct netdev_queue *q) {}
+#endif
+
+/* u64_stats_init() is 3.13; before it a zeroed syncp is a valid one */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0)
+#define u64_stats_init(syncp)	memset(syncp, 0, sizeof(*(syncp)))
+#endif
+
+/* The sparse __rcu annotation, for the classifier table, is 2.6.37 */
+#ifndef __rcu
+#define __rcu
+#endif
+
+/* Fragment accessors (3.2) and one-argument kmap_atomic (3.4), for tx SG */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,2,0)
+static inline struct page *skb_frag_page(const skb_frag_t *frag)
+{
+	return frag->page;
+}
+static inline unsigned int skb_frag_size(const skb_frag_t *frag)
+{
+	return frag->size;
+}
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,4,0) /* tx copies: bh disabled */
+#define wrn_kmap_atomic(page)	kmap_atomic(page, KM_SOFTIRQ0)
+#define wrn_kunmap_atomic(addr)	kunmap_atomic(addr, KM_SOFTIRQ0)
+#else
+#define wrn_kmap_atomic(page)	kmap_atomic(page)
+#define wrn_kunmap_atomic(addr)	kunmap_atomic(addr)
+#endif
+
+/* Used by the rx address filter; 3.5 replaced compare_ether_addr() */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,5,0)
+#include <linux/etherdevice.h>
+static inline bool ether_addr_equal(const u8 *addr1, const u8 *addr2)
+{
+	return !compare_ether_addr(addr1, addr2);
+}
+#endif
+
 #define DRV_NAME "wr-nic" /* Used in messages and device/driver names */
 #define DRV_VERSION "0.1" /* For ethtool->get_drvinfo -- FIXME: auto-vers */
 
@@ -42,7 +115,40 @@
 #define WRN_IRQ_NAMES {"wr-nic", "wr-tstamp"}
 #define WRN_IRQ_HANDLERS {wrn_interrupt, wrn_tstamp_interrupt}
 
-#define WRN_TS_BUF_SIZE 1024 /* array of timestamp structures */
+#define WRN_TS_BUF_SIZE 1024 /* stamp tables, by frame id: power of 2 */
+#define WRN_TS_SLOT(id) ((id) & (WRN_TS_BUF_SIZE - 1)) /* see timestamp.c */
+
+#define WRN_NAPI_WEIGHT 64 /* RX descriptors processed per poll */
+#define WRN_COAL_MAX_USECS 10000 /* ethtool -C limit, see nic-core.c */
+#define WRN_RX_POOL_SIZE WRN_NAPI_WEIGHT /* full-size rx skbs, see nic-core.c */
+#define WRN_RX_SKB_SIZE (WRN_MTU + 16)
+#define WRN_RX_HASH_BITS 6 /* ep->rx_hash is a 64-bit bitmap */
+#define WRN_RX_PEEK_LEN (ETH_HLEN + VLAN_HLEN) /* what the classifier sees */
+#define WRN_RX_COPYBREAK 256 /* smaller frames get a small skb */
+#define WRN_MDIO_TIMEOUT_US 1000 /* a transfer is 64 bits at a few MHz */
+#define WRN_PHY_NR_CACHED 3 /* BMCR, ADVERTISE, WR_SPEC: see endpoint.c */
+
+/*
+ * Each endpoint has two tx queues: PTP frames are sent with strict
+ * priority, the rest goes through deficit round robin (nic-core.c)
+ */
+enum wrn_txq {
+	WRN_TXQ_PTP = 0,
+	WRN_TXQ_BULK,
+	WRN_NR_TXQ,
+};
+/*
+ * Multi-port transmit, only with the mark_portmask module parameter, as
+ * skb->mark is otherwise left to fwmark users: a frame sent on any wr port
+ * with WRN_MARK_PORTMASK set in skb->mark (e.g. SO_MARK on a packet socket)
+ * is written once and sent on every port in the low bits of the mark.
+ * Bit n is endpoint n (wr<n>); tx counters are charged to the sending port
+ */
+#define WRN_MARK_PORTMASK	0x80000000
+#define WRN_MARK_PORTS		((1 << WRN_NR_ENDPOINTS) - 1)
+
+#define WRN_TXQ_LEN	32		/* frames queued per endpoint queue */
+#define WRN_DRR_QUANTUM	WRN_MTU		/* at least one frame per round */
 
 struct wrn_ep; /* Defined later */
 
@@ -58,15 +164,22 @@ struct wrn_tx_tstamp {
 struct wrn_desc_pending {
 	struct sk_buff *skb;
 	u32 id; /* only 16 bits, actually */
+	int buf_end; /* end of the tx buffer, released at tx-done time */
+	int gen; /* BQL generation of the endpoint queue (see nic-core.c) */
 };
 
 /*
  * This is the main data structure for our NIC device. As for locking,
  * the rule is that _either_ the wrn _or_ the endpoint is locked. Not both.
  */
+struct wrn_cls_table; /* private to classify.c */
+
 struct wrn_dev {
 	/* Base addresses. It's easier with an array, but not all are used */
 	void __iomem		*bases[WRN_NR_OF_BLOCKS];
+	resource_size_t		phys[WRN_NR_OF_BLOCKS]; /* for wr-regs */
+	struct miscdevice	regs_misc;
+	int			regs_misc_registered;
 
 	struct NIC_WB __iomem	*regs; /* shorthand for NIC-block registers */
 	struct TXTSU_WB __iomem *txtsu_regs; /* ... and the same for TXTSU */
@@ -78,13 +191,74 @@ struct wrn_dev {
 	void __iomem		*databuf; /* void to ease pointer arith */
 	int			next_tx_head, next_tx_tail;
 	int			next_rx;
+	int			frame_max, desc_size; /* rx slot, all endpoints */
+	int			tx_inflight; /* tx descriptors not yet done */
+	int			rings_busy; /* wrn_set_rings() at work */
+	int			tx_copying; /* see wrn_tx_schedule() */
+	int			txbuf_head, txbuf_tail; /* see nic-mem.h */
+	int			ptp_next, drr_next, drr_granted; /* tx sched */
+
+	/*
+	 * The RX ring is shared by all endpoints, so NAPI lives in
+	 * the device and uses a dummy netdev (like other multi-port NICs)
+	 */
+	struct net_device	napi_dev;
+	struct napi_struct	napi;
+
+	struct sk_buff_head	rx_pool; /* preallocated rx skbs */
+	struct work_struct	rx_refill;
+
+	/* Interrupt moderation (ethtool -C): 0 usecs means disabled */
+	int			rx_usecs, rx_frames, tx_usecs, tx_frames;
+	struct hrtimer		rx_timer, tx_timer;
+	struct tasklet_struct	tx_tasklet; /* tx done, see nic-core.c */
 
 	/* For TX descriptors, we must keep track of the ownwer */
 	struct wrn_desc_pending	skb_desc[WRN_NR_TXDESC];
 	int			id;
 
+	u64			rx_no_oob; /* no port known: not per endpoint */
+	struct u64_stats_sync	rx_syncp;
+
 	struct net_device	*dev[WRN_NR_ENDPOINTS];
 	struct wrn_tx_tstamp	ts_buf[WRN_TS_BUF_SIZE];
+	struct wrn_desc_pending	ts_skb[WRN_TS_BUF_SIZE]; /* wait for stamp */
+	struct wrn_tstamp_ring	*ts_ring; /* for mmap, see timestamp.c */
+	struct wrn_cls_table __rcu *cls; /* see classify.c */
+	struct miscdevice	ts_misc;
+	wait_queue_head_t	ts_wait;
+	int			ts_misc_registered;
+
+	/* DMTD phase ring (see dmtd.c) */
+	struct wrn_dmtd_ring	*dmtd_ring;
+	struct miscdevice	dmtd_misc;
+	wait_queue_head_t	dmtd_wait;
+	int			dmtd_misc_registered;
+	atomic_t		dmtd_users; /* the work runs while open */
+	struct delayed_work	dmtd_work;
+
+	/* PTP frame channel (see ptp-chan.c) */
+	struct wrn_pch_ring	*pch_ring;
+	struct miscdevice	pch_misc;
+	wait_queue_head_t	pch_wait;
+	int			pch_misc_registered;
+	unsigned long		pch_busy; /* bit 0: open; napi delivers */
+
+#ifdef WRN_HAS_PHC
+	/* PTP hardware clock (see pps.c) */
+	struct ptp_clock	*ptp_clock;
+	struct ptp_clock_info	ptp_info;
+	spinlock_t		ptp_lock;
+	struct delayed_work	ptp_work; /* emulates adjfreq */
+	s32			ptp_ppb;
+	s64			ptp_frac, ptp_ns; /* remainders of adjfreq */
+	ktime_t			ptp_last;
+#endif
+
+	struct delayed_work	rmon_work; /* RMON snapshot, see endpoint.c */
+	struct delayed_work	link_work; /* link poller, see endpoint.c */
+	unsigned long		link_interval;
+	struct mutex		mdio_mutex; /* all phy access, any endpoint */
 
 	/* FIXME: all dev fields must be verified */
 
@@ -96,6 +270,22 @@ struct wrn_dev {
 
 	int use_count; /* only used at probe time */
 	int irq_registered;
+	int napi_registered;
+	int works_running; /* rmon and link */
+};
+
+/*
+ * Software counters, one set for tx and one for rx as they have different
+ * writers. Not all fields are used in both sets
+ */
+struct wrn_ep_stats {
+	u64			packets;
+	u64			bytes;
+	u64			errors;
+	u64			desc_full; /* tx: frame queued with ring full */
+	u64			alloc_fail; /* rx: frame dropped, no skb */
+	u64			filtered; /* rx: address filter, classifier */
+	struct u64_stats_sync	syncp;
 };
 
 /* Each network device (endpoint) has one such priv structure */
@@ -103,13 +293,28 @@ struct wrn_ep {
 	struct wrn_dev		*wrn;
 	struct EP_WB __iomem	*ep_regs; /* each EP has its own memory */
 	spinlock_t		lock;
-	struct timer_list	ep_link_timer;
 	volatile unsigned long	ep_flags;
 	struct mii_if_info	mii; /* for ethtool operations */
+	u16			phy_cache[WRN_PHY_NR_CACHED]; /* endpoint.c */
+	unsigned long		phy_cache_valid; /* under wrn->mdio_mutex */
 	int			ep_number;
 	int			pkt_count; /* used for tx stamping ID */
 
-	struct net_device_stats	stats;
+	/* Software tx queues, protected by the wrn lock */
+	struct sk_buff_head	txq[WRN_NR_TXQ];
+	int			deficit;
+	int			txq_gen;
+
+	struct wrn_ep_stats	tx_stats; /* written and read under wrn->lock */
+	struct wrn_ep_stats	rx_stats; /* written by napi */
+	u64			rx_hash; /* address filter, see nic-core.c */
+	u64			rmon[EP_RMON_RAM_WORDS]; /* see endpoint.c */
+	u32			rmon_last[EP_RMON_RAM_WORDS];
+
+	/* DMTD phase, see dmtd.c */
+	int			dmtd_avg; /* N_AVG, programmed at open */
+	u32			dmtd_phase; /* last result collected */
+	int			dmtd_new; /* not yet returned by the ioctl */
 	//struct sk_buff		*current_skb;
 
 	//bool synced;
@@ -118,12 +323,24 @@ struct wrn_ep {
 	//u32 cur_rx_desc;
 };
 #define WRN_LINK_POLL_INTERVAL (HZ/5)
+#define WRN_LINK_POLL_MAX (2*HZ) /* backoff limit while all links are down */
+#define WRN_RMON_INTERVAL HZ /* well below 32-bit wrap at 1Gb/s */
+
+/* RMON_RAM words we use (see endpoint-regs.wb for the full list) */
+#define WRN_RMON_TX_UNDERRUN	0
+#define WRN_RMON_RX_OVERRUN	3
+#define WRN_RMON_RX_CRC		4
+#define WRN_RMON_RX_RUNT	6
+#define WRN_RMON_RX_GIANT	7
 
 enum ep_flags { /* only used in the ep_flags register */
 	WRN_EP_UP		= 0,
 	WRN_EP_IS_UPLINK	= 1,
 	WRN_EP_STAMPING_TX	= 2,
 	WRN_EP_STAMPING_RX	= 3,
+	WRN_EP_POLL_LINK	= 4, /* open: wrn_link_work() checks it */
+	WRN_EP_RX_PROMISC	= 5, /* rx filter: accept everything */
+	WRN_EP_RX_ALLMULTI	= 6, /* rx filter: accept all multicast */
 };
 
 /* Our resources. */
@@ -163,6 +380,10 @@ enum wrn_resnames {
 #define PRIV_IOCGGETPHASE	(SIOCDEVPRIVATE + 2)
 #define PRIV_IOCREADREG		(SIOCDEVPRIVATE + 3)
 #define PRIV_IOCPHYREG		(SIOCDEVPRIVATE + 4)
+#define PRIV_IOCSCLASSIFY	(SIOCDEVPRIVATE + 5) /* struct wrn_cls_req */
+#define PRIV_IOCGCLASSIFY	(SIOCDEVPRIVATE + 6)
+#define PRIV_IOCREADREGS	(SIOCDEVPRIVATE + 7) /* struct wrn_regs_req */
+#define PRIV_IOCSDMTDAVG	(SIOCDEVPRIVATE + 8) /* u32: samples */
 
 #define NIC_READ_PHY_CMD(addr)  (((addr) & 0xff) << 16)
 #define NIC_RESULT_DATA(val) ((val) & 0xffff)
@@ -182,8 +403,172 @@ struct wrn_phase_req {
 	int ready;
 	u32 phase;
 };
-#define WRN_DMTD_AVG_SAMPLES 256
+/*
+ * Batched endpoint register reads. All values are read in one pass, with
+ * interrupts disabled, so they are a consistent snapshot. Offsets are in
+ * bytes, as for PRIV_IOCREADREG; WRN_REGS_ALL returns the whole EP_WB.
+ */
+#define WRN_REGS_MAX		(sizeof(struct EP_WB) / sizeof(u32))
+
+enum wrn_regs_cmd {
+	WRN_REGS_ALL = 0,
+	WRN_REGS_RANGE,		/* n words from offset */
+	WRN_REGS_LIST,		/* n words, at off[0..n-1] */
+};
+
+struct wrn_regs_req {
+	u32 cmd;
+	u32 n;
+	u32 offset;
+	u32 off[WRN_REGS_MAX];
+	u32 val[WRN_REGS_MAX];
+};
+
+/*
+ * /dev/wr-regs maps the endpoint and PPS generator registers read-only,
+ * for monitoring with no syscall: the endpoints at offset 0 (each at
+ * FPGA_SIZE_EACH_EP from the previous one), the PPSG after them.
+ */
+#define WRN_REGS_MMAP_EP	0
+#define WRN_REGS_MMAP_PPSG	FPGA_SIZE_EP
+#define WRN_REGS_MMAP_SIZE	(FPGA_SIZE_EP + FPGA_SIZE_PPSG)
+
+/*
+ * Rx classifier rules (see classify.c). The table is shared by all
+ * endpoints and the first matching rule wins. Matching is done on the
+ * frame in packet memory, before an skb is allocated. Frames that
+ * match no rule go through the address filter as usual; PASS skips it.
+ */
+#define WRN_CLS_MAX_RULES	32
+#define WRN_CLS_NO_VID		0xffff /* "vid" of untagged frames */
+
+#define WRN_CLS_M_PORT		0x01
+#define WRN_CLS_M_ETYPE		0x02 /* inner ethertype if tagged */
+#define WRN_CLS_M_VLAN		0x04
+#define WRN_CLS_M_DMAC		0x08 /* under dmac_mask */
+#define WRN_CLS_M_ALL		0x0f
+
+enum wrn_cls_action {
+	WRN_CLS_NOMATCH = 0,	/* internal, not valid in rules */
+	WRN_CLS_PASS,
+	WRN_CLS_DROP,
+	WRN_CLS_MIRROR,		/* arg: endpoint that gets a copy too */
+	WRN_CLS_PRIO,		/* arg: skb->priority */
+};
+
+struct wrn_cls_rule {
+	u32 match;
+	u32 port;
+	u16 ethertype;
+	u16 vid;
+	u8 dmac[ETH_ALEN];
+	u8 dmac_mask[ETH_ALEN];
+	u16 action;
+	u16 arg;
+	u64 hits;	/* only read back */
+};
+
+struct wrn_cls_req {
+	u32 n_rules;
+	struct wrn_cls_rule rule[WRN_CLS_MAX_RULES];
+};
+
+/*
+ * The tx stamp ring, as mmap()ed from /dev/wr-tstamp. The kernel writes
+ * a record, then increments head (free-running, so the record is at
+ * head % size). The reader consumes records up to head and stores its
+ * own position in tail, which is only used by poll(): only one reader
+ * can rely on poll. If head moved by more than size while reading, the
+ * reader was overrun and lost records.
+ */
+#define WRN_TSTAMP_RING_SIZE 1024 /* power of 2 */
+
+struct wrn_tstamp_rec {
+	u16 port_id;
+	u16 frame_id;
+	u32 sec;	/* resolved from the PPS generator */
+	u32 nsec;
+	u32 unused;
+};
+
+struct wrn_tstamp_ring {
+	u32 head;	/* written by the kernel */
+	u32 tail;	/* written by user space */
+	u32 size;	/* WRN_TSTAMP_RING_SIZE */
+	u32 unused[13];	/* records start at 64 bytes */
+	struct wrn_tstamp_rec rec[WRN_TSTAMP_RING_SIZE];
+};
+
+/*
+ * The PTP frame channel, /dev/wr-ptp (see ptp-chan.c). While it is open,
+ * received PTP frames (ETH_P_1588, untagged) go to this ring instead of
+ * the network stack, with their stamp. The ring works like the stamp
+ * ring above. Frames are sent by write(): a struct wrn_pch_txhdr and
+ * the frame. The stamp id of the last frame sent is in tx_id, to be
+ * matched with records in the stamp ring.
+ */
+#define WRN_PCH_RING_SIZE	256 /* power of 2 */
+#define WRN_PCH_FRAME_SIZE	238 /* record is 256 bytes */
+
+#define WRN_PCH_F_AHEAD		0x01 /* rising-edge counter was ahead */
+#define WRN_PCH_F_STAMP		0x02 /* tx: request a stamp */
+
+struct wrn_pch_rec {
+	u32 sec;
+	u32 nsec;
+	u16 port;
+	u16 len;
+	u16 flags;
+	u16 unused[2];	/* the second is overwritten when copying data */
+	u8 data[WRN_PCH_FRAME_SIZE]; /* 2 mod 4, as in packet memory */
+};
+
+struct wrn_pch_ring {
+	u32 head;	/* written by the kernel */
+	u32 tail;	/* written by user space */
+	u32 size;	/* WRN_PCH_RING_SIZE */
+	u32 tx_id;	/* stamp id of the last frame written */
+	u32 unused[12];	/* records start at 64 bytes */
+	struct wrn_pch_rec rec[WRN_PCH_RING_SIZE];
+};
+
+struct wrn_pch_txhdr {
+	u16 port;
+	u16 flags;
+};
+
+#define WRN_DMTD_AVG_SAMPLES 256 /* default, PRIV_IOCSDMTDAVG changes it */
 #define WRN_DMTD_MAX_PHASE 16384
+/* PS_VAL is a signed 24-bit sum of N_AVG phases: 511, not the 12-bit max */
+#define WRN_DMTD_AVG_MAX ((1 << 23) / WRN_DMTD_MAX_PHASE - 1)
+
+/*
+ * The DMTD phase ring, as mmap()ed from /dev/wr-dmtd (see dmtd.c). It
+ * works like the stamp ring: every new result of any running endpoint
+ * is a record, stamped with WR time when it was collected. The NIC has
+ * no DMTD interrupt, so results are collected every WRN_DMTD_INTERVAL
+ * while the device is open: that's the resolution of the stamp.
+ */
+#define WRN_DMTD_RING_SIZE	1024 /* power of 2 */
+#define WRN_DMTD_INTERVAL	DIV_ROUND_UP(HZ, 100) /* 10ms, or one jiffy */
+
+struct wrn_dmtd_rec {
+	u32 sec;
+	u32 nsec;
+	u16 port;
+	u16 n_avg;	/* averaging window of this result */
+	u32 phase;	/* averaged, 0 .. WRN_DMTD_MAX_PHASE - 1 */
+	s32 raw;	/* the sum from DMSR, sign-extended */
+	u32 unused[3];
+};
+
+struct wrn_dmtd_ring {
+	u32 head;	/* written by the kernel */
+	u32 tail;	/* written by user space */
+	u32 size;	/* WRN_DMTD_RING_SIZE */
+	u32 unused[13];	/* records start at 64 bytes */
+	struct wrn_dmtd_rec rec[WRN_DMTD_RING_SIZE];
+};
 
 #define WRN_CAL_TX_ON 1
 #define WRN_CAL_TX_OFF 2
@@ -200,11 +585,20 @@ struct wrn_phase_req {
 
 /* Following functions are in nic-core.c */
 extern irqreturn_t wrn_interrupt(int irq, void *dev_id);
+extern int wrn_poll(struct napi_struct *napi, int budget);
+extern void wrn_coalesce_init(struct wrn_dev *wrn);
+extern void wrn_rx_pool_init(struct wrn_dev *wrn);
+extern void wrn_rx_pool_exit(struct wrn_dev *wrn);
+extern void wrn_coalesce_stop(struct wrn_dev *wrn);
 extern int wrn_netops_init(struct net_device *netdev);
+extern void wrn_ep_reset_txq(struct net_device *dev);
+extern int wrn_tx_raw(struct wrn_dev *wrn, int port, void *data, int len,
+		      int do_stamp);
 
-/* Following data in device.c */
+/* Following data and functions in device.c */
 struct platform_driver;
 extern struct platform_driver wrn_driver;
+extern int wrn_set_rings(struct wrn_dev *wrn, int frame);
 
 /* Following functions in ethtool.c */
 extern int wrn_ethtool_init(struct net_device *netdev);
@@ -212,10 +606,20 @@ extern int wrn_ethtool_init(struct net_device *netdev);
 /* Following functions in endpoint.c */
 extern int wrn_phy_read(struct net_device *dev, int phy_id, int location);
 extern void wrn_phy_write(struct net_device *dev, int phy_id, int loc, int v);
+extern int wrn_phy_read_uncached(struct net_device *dev, int location);
+extern void wrn_ep_read_regs(struct wrn_ep *ep, const u32 *off, int n,
+			     u32 *val);
+extern int wrn_ep_regs_ioctl(struct net_device *dev, struct ifreq *rq,
+			     int cmd);
 
 extern int wrn_ep_open(struct net_device *dev);
 extern int wrn_ep_close(struct net_device *dev);
 
+extern void wrn_rmon_init(struct wrn_dev *wrn);
+extern void wrn_rmon_exit(struct wrn_dev *wrn);
+extern void wrn_link_init(struct wrn_dev *wrn);
+extern void wrn_link_exit(struct wrn_dev *wrn);
+
 extern int  wrn_endpoint_probe(struct net_device *netdev);
 extern void wrn_endpoint_remove(struct net_device *netdev);
 
@@ -224,10 +628,38 @@ extern void wrn_tstamp_find_skb(struct wrn_dev *wrn, int i);
 extern int wrn_tstamp_ioctl(struct net_device *dev, struct ifreq *rq, int cmd);
 extern irqreturn_t wrn_tstamp_interrupt(int irq, void *dev_id);
 extern void wrn_tstamp_init(struct wrn_dev *wrn);
+extern void wrn_tstamp_release(struct wrn_dev *wrn);
 
 /* Following functions from dmtd.c */
 extern int wrn_phase_ioctl(struct net_device *dev, struct ifreq *rq, int cmd);
 extern int wrn_calib_ioctl(struct net_device *dev, struct ifreq *rq, int cmd);
+extern int wrn_dmtd_avg_ioctl(struct net_device *dev, struct ifreq *rq,
+			      int cmd);
+extern void wrn_dmtd_init(struct wrn_dev *wrn);
+extern void wrn_dmtd_exit(struct wrn_dev *wrn);
+
+/* Following functions from classify.c */
+extern int wrn_classify(struct wrn_dev *wrn, int port, const u8 *hdr, int *arg);
+extern int wrn_cls_ioctl(struct net_device *dev, struct ifreq *rq, int cmd);
+extern void wrn_cls_exit(struct wrn_dev *wrn);
+
+/* Following functions from ptp-chan.c */
+extern void wrn_pch_rx(struct wrn_dev *wrn, int port, u32 __iomem *frame,
+		       int len, struct timespec *ts);
+extern void wrn_pch_init(struct wrn_dev *wrn);
+extern void wrn_pch_exit(struct wrn_dev *wrn);
+
+/* Following functions from pps.c */
 extern void wrn_ppsg_read_time(struct wrn_dev *wrn, u32 *fine_cnt, u32 *utc);
+extern void wrn_ptp_init(struct wrn_dev *wrn, struct device *parent);
+extern void wrn_ptp_exit(struct wrn_dev *wrn);
+extern int wrn_ptp_index(struct wrn_dev *wrn);
+
+/* Following function from bench.c, only built with WRN_BENCH=y */
+#ifdef WRN_BENCH
+extern void wrn_bench_run(struct wrn_dev *wrn);
+#else
+static inline void wrn_bench_run(struct wrn_dev *wrn) {}
+#endif
 
 #endif /* __WR_NIC_H__ */